@@ -0,0 +1,229 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Userspace microbenchmark of the aesd circular buffer
+ *
+ * Measures aesd_circular_buffer_add_entry, aesd_circular_buffer_find_entry_offset_for_fpos
+ * and aesd_size over a grid of capacities, entry sizes and thread counts. Threads share one
+ * buffer the way the driver does: writers hold a write lock, lookups a read lock. Every
+ * operation is timed on its own for the latency percentiles. Results are printed as one JSON
+ * object on stdout, so runs can be compared across commits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "aesd-circular-buffer.h"
+
+enum bench_op {
+    OP_ADD,
+    OP_FIND,
+    OP_SIZE,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+    "add_entry",
+    "find_entry_offset_for_fpos",
+    "size",
+};
+
+struct bench_t {
+    enum bench_op op;
+    struct aesd_circular_buffer buffer;
+    pthread_rwlock_t lock;
+    struct aesd_buffer_entry entry;
+    long ops;
+    pthread_barrier_t start;
+};
+
+struct thread_t {
+    pthread_t tid;
+    struct bench_t *bench;
+    unsigned int seed;
+    unsigned long long *latency;
+    unsigned long long sink;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* thread_entry(void *args)
+{
+    struct thread_t *t = (struct thread_t*)args;
+    struct bench_t *b = t->bench;
+    struct aesd_buffer_entry *e;
+    unsigned long long start;
+    size_t offset;
+    long i;
+
+    pthread_barrier_wait(&b->start);
+    for(i = 0; i < b->ops; i++)
+    {
+        start = now_ns();
+        switch(b->op)
+        {
+            case OP_ADD:
+                pthread_rwlock_wrlock(&b->lock);
+                //entries point at one static payload, nothing to free on eviction
+                aesd_circular_buffer_add_entry(&b->buffer, &b->entry);
+                pthread_rwlock_unlock(&b->lock);
+                break;
+            case OP_FIND:
+                pthread_rwlock_rdlock(&b->lock);
+                e = aesd_circular_buffer_find_entry_offset_for_fpos(&b->buffer,
+                        rand_r(&t->seed) % aesd_size(&b->buffer), &offset);
+                pthread_rwlock_unlock(&b->lock);
+                t->sink += offset + (e != NULL);
+                break;
+            case OP_SIZE:
+                pthread_rwlock_rdlock(&b->lock);
+                t->sink += aesd_size(&b->buffer);
+                pthread_rwlock_unlock(&b->lock);
+                break;
+            default:
+                break;
+        }
+        t->latency[i] = now_ns() - start;
+    }
+    return 0;
+}
+
+static int compare(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Runs one benchmark and prints its result object.
+ * @return 0 on success, -1 on error
+ */
+static int run(enum bench_op op, uint32_t capacity, size_t entry_size, int threads, long ops, int first)
+{
+    struct bench_t b;
+    struct thread_t *t;
+    unsigned long long *latency;
+    unsigned long long start, elapsed, sum;
+    char *payload;
+    size_t total, i;
+    int n;
+
+    memset(&b, 0, sizeof(b));
+    if(aesd_circular_buffer_init_capacity(&b.buffer, capacity) != 0)
+        return -1;
+    payload = (char*)malloc(entry_size);
+    t = (struct thread_t*)calloc(threads, sizeof(struct thread_t));
+    total = (size_t)threads * ops;
+    latency = (unsigned long long*)malloc(total * sizeof(unsigned long long));
+    if(payload == NULL || t == NULL || latency == NULL)
+        return -1;
+    memset(payload, 'a', entry_size);
+    b.op = op;
+    b.ops = ops;
+    b.entry.buffptr = payload;
+    b.entry.size = entry_size;
+    pthread_rwlock_init(&b.lock, 0);
+    pthread_barrier_init(&b.start, 0, threads);
+    //lookups run against a full buffer
+    for(i = 0; i < capacity; i++)
+        aesd_circular_buffer_add_entry(&b.buffer, &b.entry);
+
+    start = now_ns();
+    for(n = 0; n < threads; n++)
+    {
+        t[n].bench = &b;
+        t[n].seed = n + 1;
+        t[n].latency = &latency[(size_t)n * ops];
+        if(pthread_create(&t[n].tid, 0, thread_entry, &t[n]) != 0)
+            return -1;
+    }
+    for(n = 0; n < threads; n++)
+        pthread_join(t[n].tid, 0);
+    elapsed = now_ns() - start;
+
+    qsort(latency, total, sizeof(*latency), compare);
+    for(sum = 0, i = 0; i < total; i++)
+        sum += latency[i];
+    printf("%s    {\"op\": \"%s\", \"capacity\": %u, \"entry_size\": %zu, \"threads\": %d, \"ops\": %zu, "
+            "\"ops_per_s\": %.0f, \"mean_ns\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}",
+            first ? "" : ",\n", op_names[op], capacity, entry_size, threads, total,
+            total / (elapsed / 1e9), (double)sum / total,
+            latency[total / 2], latency[(size_t)(total * 0.99)], latency[total - 1]);
+
+    pthread_barrier_destroy(&b.start);
+    pthread_rwlock_destroy(&b.lock);
+    aesd_circular_buffer_free(&b.buffer);
+    free(latency);
+    free(t);
+    free(payload);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n operations per thread] [-t max threads]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t capacities[] = { 10, 64, 1024 };
+    static const size_t entry_sizes[] = { 16, 256, 4096 };
+    long ops = 200000;
+    int max_threads = 4;
+    int first = 1;
+    int op, threads, opt;
+    size_t c, s;
+
+    while((opt = getopt(argc, argv, "n:t:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                ops = atol(optarg);
+                break;
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(ops <= 0 || max_threads <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("{\n  \"ops_per_thread\": %ld,\n  \"results\": [\n", ops);
+    for(op = 0; op < OP_COUNT; op++)
+    {
+        for(c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++)
+        {
+            for(s = 0; s < sizeof(entry_sizes) / sizeof(entry_sizes[0]); s++)
+            {
+                for(threads = 1; threads <= max_threads; threads *= 2)
+                {
+                    if(run((enum bench_op)op, capacities[c], entry_sizes[s], threads, ops, first) < 0)
+                    {
+                        perror("run");
+                        return 1;
+                    }
+                    first = 0;
+                }
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -10,8 +10,10 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/slab.h>
 #else
 #include <string.h>
+#include <stdlib.h>
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -19,6 +21,8 @@
 
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
+ *      Every ring access is masked, so a lookup racing a writer stays in bounds and can be
+ *      retried by a seqlock reader.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
  *      character index if all buffer strings were concatenated end to end
  * @param entry_offset_byte_rtn is a pointer specifying a location to store the byte of the returned aesd_buffer_entry
@@ -30,47 +34,34 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t cumulative_size = 0;
-    struct aesd_buffer_entry *entry, *result;
-    size_t i;
-    size_t entry_index, total_entries;
+    struct aesd_buffer_entry *result;
+    uint64_t target;
+    uint32_t lo, hi, mid;
 
     result = 0;
-#ifdef __KERNEL__
-    mutex_lock(&buffer->mtx);
-#else
-    pthread_mutex_lock(&buffer->mtx);
-#endif /* __KERNEL__ */
-    
-    entry_index = buffer->out_offs;
-  
-    // Determine the total number of entries in the buffer  
-    total_entries = buffer->full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : buffer->in_offs;
-  
-    // Iterate through the circular buffer entries  
-    for (i = 0; i < total_entries; i++) {
-        entry = &buffer->entry[entry_index];
-  
-        // Check if the char_offset is within the current entry's range  
-        if (char_offset < cumulative_size + entry->size) {
-            // Found the corresponding entry
-            *entry_offset_byte_rtn = char_offset - cumulative_size;
-            result = entry;
-            break;
-        }
-  
-        // Update cumulative size and move to the next entry  
-        cumulative_size += entry->size;
-        entry_index = (entry_index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+    if (char_offset >= buffer->total_size)
+        goto out;
+
+    target = buffer->base + char_offset;
+
+    // Binary search for the last entry starting at or before target, entry_start grows
+    // monotonically from out_offs on
+    lo = 0;
+    hi = aesd_circular_buffer_count(buffer) - 1;
+    while (lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        if (buffer->entry_start[(buffer->out_offs + mid) & buffer->mask] <= target)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
+    lo = (buffer->out_offs + lo) & buffer->mask;
+    *entry_offset_byte_rtn = target - buffer->entry_start[lo];
+    result = &buffer->entry[lo];
 
-#ifdef __KERNEL__
-    mutex_unlock(&buffer->mtx);
-#else
-    pthread_mutex_unlock(&buffer->mtx);
-#endif /* __KERNEL__ */
-  
-    // If we reach here, the char_offset is not in the buffer  
+out:
+    // NULL if the char_offset is not in the buffer
     return result;
 }
 
@@ -80,72 +71,116 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the evicted entry, for the caller to free, or NULL
 */
 void* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
     void *result;
+    struct aesd_buffer_entry *oldest;
+    uint32_t slot;
+
+    //without a ring the entry is dropped right away
+    if (buffer->entry == NULL)
+        return (void*) add_entry->buffptr;
 
     result = 0;
-#ifdef __KERNEL__
-    mutex_lock(&buffer->mtx);
-#else
-    pthread_mutex_lock(&buffer->mtx);
-#endif /* __KERNEL__ */
     
     // Check if the buffer is full  
     if (buffer->full) {  
-        // If the buffer is full, advance the out_offs to overwrite the oldest entry  
-        result = (void*) buffer->entry[buffer->out_offs].buffptr;
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        // If the buffer is full, advance the out_offs to drop the oldest entry, its slot is
+        // cleared since it is not necessarily the one reused below
+        oldest = &buffer->entry[buffer->out_offs & buffer->mask];
+        result = (void*) oldest->buffptr;
+        buffer->base += oldest->size;
+        buffer->total_size -= oldest->size;
+        oldest->buffptr = NULL;
+        oldest->size = 0;
+        buffer->out_offs++;
     }  
   
     // Add the new entry at the current in_offs position
-    //memcpy(&buffer->entry[buffer->in_offs], add_entry, sizeof(struct aesd_buffer_entry));
-    buffer->entry[buffer->in_offs] = *add_entry;  
+    slot = buffer->in_offs & buffer->mask;
+    buffer->entry[slot] = *add_entry;  
+    buffer->entry_start[slot] = buffer->base + buffer->total_size;
+    buffer->total_size += add_entry->size;
   
     // Advance the in_offs to the next position  
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;  
+    buffer->in_offs++;
   
-    // If in_offs equals out_offs after advancing, it means the buffer is full  
-    if (buffer->in_offs == buffer->out_offs) {  
-        buffer->full = true;  
-    } else {  
-        buffer->full = false;  
+    buffer->full = aesd_circular_buffer_count(buffer) == buffer->capacity;
+
+    return result;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding up to
+* @param capacity entries. The ring is rounded up to a power of two slots.
+* @return 0 on success, -ENOMEM (kernel) or -1 (user space) if the ring cannot be allocated
+*/
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    uint32_t slots;
+
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    if (capacity == 0 || capacity > (1U << 31))
+        goto fail;
+    for (slots = 1; slots < capacity; slots <<= 1);
+
+#ifdef __KERNEL__
+    buffer->entry = kcalloc(slots, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    buffer->entry_start = kcalloc(slots, sizeof(uint64_t), GFP_KERNEL);
+#else
+    buffer->entry = calloc(slots, sizeof(struct aesd_buffer_entry));
+    buffer->entry_start = calloc(slots, sizeof(uint64_t));
+#endif /* __KERNEL__ */
+    if (buffer->entry == NULL || buffer->entry_start == NULL) {
+        aesd_circular_buffer_free(buffer);
+        goto fail;
     }
+    buffer->capacity = capacity;
+    buffer->mask = slots - 1;
+    return 0;
 
+fail:
 #ifdef __KERNEL__
-    mutex_unlock(&buffer->mtx);
+    return -ENOMEM;
 #else
-    pthread_mutex_unlock(&buffer->mtx);
+    return -1;
 #endif /* __KERNEL__ */
-    return result;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct holding up to
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
-    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    aesd_circular_buffer_init_capacity(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+* Releases the ring of @param buffer. Memory referenced by the entries is managed by the caller
+* and has to be released first, see AESD_CIRCULAR_BUFFER_FOREACH.
+*/
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
+{
 #ifdef __KERNEL__
-    mutex_init(&buffer->mtx);
+    kfree(buffer->entry);
+    kfree(buffer->entry_start);
 #else
-    pthread_mutex_init(&buffer->mtx, 0);
+    free(buffer->entry);
+    free(buffer->entry_start);
 #endif /* __KERNEL__ */
+    buffer->entry = NULL;
+    buffer->entry_start = NULL;
+    buffer->capacity = 0;
+    buffer->mask = 0;
 }
 
-
+/**
+* @return the number of bytes held in @param b, kept up to date by aesd_circular_buffer_add_entry
+*/
 uint64_t aesd_size(struct aesd_circular_buffer *b)
 {
-    uint64_t result;
-    uint8_t idx;
-
-    idx = b->out_offs;
-    result = 0;
-    while (b->in_offs != idx)
-    {
-        result += b->entry[idx].size;
-        idx = (idx + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
-    return result;
-}
\ No newline at end of file
+    return b->total_size;
+}
@@ -10,15 +10,19 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
-#include "linux/mutex.h"
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
-#include "pthread.h"
 #endif
 
+/**
+ * Default number of entries held, used by aesd_circular_buffer_init(). Override at build time
+ * or pass a capacity to aesd_circular_buffer_init_capacity().
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
@@ -35,27 +39,43 @@ struct aesd_buffer_entry
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * The ring of the most recent write operations, mask + 1 slots. The ring is a power of two
+     * in size so indices wrap with a mask instead of a division.
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Position of the first byte of each entry in the stream of all bytes ever added,
+     * so lookups can binary search instead of summing entry sizes
+     */
+    uint64_t *entry_start;
+    /**
+     * Maximum number of entries held, older ones are overwritten
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t capacity;
     /**
-     * The current location in the entry structure where the next write should
-     * be stored.
+     * Number of ring slots minus one
      */
-    uint8_t in_offs;
+    uint32_t mask;
     /**
-     * The first location in the entry structure to read from
+     * Running count of entries added. The next write is stored in slot in_offs & mask.
      */
-    uint8_t out_offs;
+    uint32_t in_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * Running index of the oldest entry held, stored in slot out_offs & mask
+     */
+    uint32_t out_offs;
+    /**
+     * set to true when the buffer holds capacity entries
      */
     bool full;
-#ifdef __KERNEL__
-    struct mutex mtx;
-#else
-    pthread_mutex_t mtx;
-#endif /* __KERNEL__ */
+    /**
+     * Stream position of the first byte still held, the start of entry out_offs
+     */
+    uint64_t base;
+    /**
+     * Number of bytes held in all entries
+     */
+    uint64_t total_size;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -65,16 +85,36 @@ extern void* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
+
 extern uint64_t aesd_size(struct aesd_circular_buffer *b);
 
+/**
+ * @return the slot holding entry number @param n, counted from the oldest entry held
+ */
+static inline struct aesd_buffer_entry *aesd_circular_buffer_nth(struct aesd_circular_buffer *buffer, uint32_t n)
+{
+    return &buffer->entry[(buffer->out_offs + n) & buffer->mask];
+}
+
+/**
+ * @return the number of entries held
+ */
+static inline uint32_t aesd_circular_buffer_count(struct aesd_circular_buffer *buffer)
+{
+    return buffer->in_offs - buffer->out_offs;
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -83,7 +123,7 @@ extern uint64_t aesd_size(struct aesd_circular_buffer *b);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            (buffer)->entry != NULL && index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
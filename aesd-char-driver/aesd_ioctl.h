@@ -33,14 +33,170 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Current length and change count of the device, returned by AESDCHAR_IOCINFO. A mapping of the
+ * device starts with this structure, describing the snapshot that directly follows it. The mapping
+ * is read only and may not be longer than this structure plus size bytes, rounded up to a page.
+ */
+struct aesd_info {
+    /**
+     * Number of content bytes
+     */
+    uint64_t size;
+    /**
+     * Incremented on every completed write command
+     */
+    uint64_t generation;
+};
+
+/**
+ * Batched read of whole commands, used with AESDCHAR_IOCRANGE. Pointers are passed as 64 bit
+ * integers so the layout is the same for 32 and 64 bit callers.
+ */
+struct aesd_range {
+    /**
+     * The zero referenced write command to start at
+     */
+    uint32_t write_cmd;
+    /**
+     * The zero referenced offset within that write command
+     */
+    uint32_t write_cmd_offset;
+    /**
+     * In: maximum number of commands to copy. Out: number of commands copied.
+     */
+    uint32_t cmd_count;
+    uint32_t reserved;
+    /**
+     * User buffer receiving the contents of the commands back to back
+     */
+    uint64_t buf;
+    uint64_t buf_size;
+    /**
+     * User array of cmd_count uint64_t receiving the number of bytes copied per command
+     */
+    uint64_t lengths;
+    /**
+     * Out: total number of bytes copied
+     */
+    uint64_t bytes;
+};
+
+/**
+ * One command as reported by AESDCHAR_IOCINDEX
+ */
+struct aesd_index_entry {
+    /**
+     * The zero referenced write command, as used with AESDCHAR_IOCSEEKTO
+     */
+    uint32_t write_cmd;
+    uint32_t reserved;
+    /**
+     * File position of the first byte of the command, usable with pread
+     */
+    uint64_t offset;
+    /**
+     * Number of bytes in the command
+     */
+    uint64_t size;
+};
+
+/**
+ * Table of the commands held, used with AESDCHAR_IOCINDEX. The table is only valid for
+ * the generation it was taken at, evicting a command shifts the offsets of the others.
+ */
+struct aesd_index {
+    /**
+     * User array of max_entries struct aesd_index_entry
+     */
+    uint64_t entries;
+    uint32_t max_entries;
+    /**
+     * Out: number of commands held
+     */
+    uint32_t count;
+    /**
+     * Out: number of content bytes and change count, as returned by AESDCHAR_IOCINFO
+     */
+    struct aesd_info info;
+};
+
+/**
+ * A saved image of a device starts with this header, followed by count uint64_t command sizes
+ * and then info.size bytes of command contents back to back, oldest command first.
+ */
+struct aesd_image_header {
+    /**
+     * AESD_IMAGE_MAGIC
+     */
+    uint32_t magic;
+    /**
+     * AESD_IMAGE_VERSION
+     */
+    uint32_t version;
+    /**
+     * Number of commands in the image
+     */
+    uint32_t count;
+    uint32_t reserved;
+    /**
+     * Number of content bytes and change count of the device when it was saved
+     */
+    struct aesd_info info;
+};
+
+#define AESD_IMAGE_MAGIC 0x44534541 /* "AESD" little endian */
+#define AESD_IMAGE_VERSION 1
+
+/**
+ * User buffer holding an image, used with AESDCHAR_IOCSAVE and AESDCHAR_IOCRESTORE
+ */
+struct aesd_image {
+    uint64_t buf;
+    uint64_t buf_size;
+    /**
+     * Out: number of bytes of the image, also set when buf is too small to save it
+     */
+    uint64_t bytes;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+#define AESDCHAR_IOCINFO _IOR(AESD_IOC_MAGIC, 2, struct aesd_info)
+/**
+ * Turns follow mode on (argument non zero) or off for this open file. In follow mode a read at the
+ * end of the data blocks until the next write command is committed, or fails with EAGAIN for
+ * O_NONBLOCK files, like tail -f. Poll reports the file readable once new data is there.
+ */
+#define AESDCHAR_IOCFOLLOW _IO(AESD_IOC_MAGIC, 3)
+/**
+ * Copies commands write_cmd onwards, starting write_cmd_offset bytes into the first one, in one call.
+ * Only whole commands that fit into buf are copied. Fails with ENOSPC if not even the first one
+ * fits, lengths[0] then holds its size. The file position is not changed.
+ */
+#define AESDCHAR_IOCRANGE _IOWR(AESD_IOC_MAGIC, 4, struct aesd_range)
+/**
+ * Fills entries with the offset and size of every command held, along with the generation they
+ * belong to, in one call. Fails with ENOSPC if max_entries is too small, count then holds the
+ * number needed, so callers can pass max_entries 0 to size the array.
+ */
+#define AESDCHAR_IOCINDEX _IOWR(AESD_IOC_MAGIC, 5, struct aesd_index)
+/**
+ * Saves all commands held as an image into buf. Fails with ENOSPC if buf is too small, bytes then
+ * holds the size needed.
+ */
+#define AESDCHAR_IOCSAVE _IOWR(AESD_IOC_MAGIC, 6, struct aesd_image)
+/**
+ * Appends the commands of a saved image as if each had been written, in one step. Readers see
+ * either none or all of them. Needs a file opened for writing.
+ */
+#define AESDCHAR_IOCRESTORE _IOW(AESD_IOC_MAGIC, 7, struct aesd_image)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 7
 
 #endif /* AESD_IOCTL_H */
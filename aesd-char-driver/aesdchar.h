@@ -8,7 +8,7 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug, or build with make DEBUG=y
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -23,17 +23,80 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 #include "aesd-circular-buffer.h"
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/wait.h>
+
+/**
+ * Header in front of the data of every entry. Readers pin an entry with a reference, so an
+ * evicted entry stays valid until the last reader is done with it.
+ */
+struct aesd_blob
+{
+    refcount_t refs;
+    /* size class the blob was allocated from, see aesd_blob_alloc() */
+    unsigned int class;
+    struct rcu_head rcu;
+    char data[];
+};
+
+/**
+ * @return the blob holding the entry data at @param buffptr
+ */
+static inline struct aesd_blob *aesd_blob_of(const char *buffptr)
+{
+    return (struct aesd_blob *)(buffptr - offsetof(struct aesd_blob, data));
+}
+
+/**
+ * Lock time histograms are powers of two, bucket i counts times below 2^i ns
+ */
+#define AESD_HIST_BUCKETS 40
+
+/**
+ * Counters exposed in debugfs. Readers do not take the device mutex, so all of them are atomic.
+ */
+struct aesd_stats
+{
+    atomic64_t reads;
+    atomic64_t writes;
+    atomic64_t bytes_read;
+    atomic64_t bytes_written;
+    atomic64_t evictions;
+    /* time spent waiting for and holding the device mutex */
+    atomic64_t lock_wait[AESD_HIST_BUCKETS];
+    atomic64_t lock_hold[AESD_HIST_BUCKETS];
+};
 
 struct aesd_dev
 {
-    /**
-     * TODO: Add structure(s) and locks needed to complete assignment requirements
-     */
     struct cdev cdev;     /* Char device structure      */
     struct aesd_circular_buffer circular_buf;
+    /* serializes writers and the ioctl, mmap and seek paths */
     struct mutex lock;
+    /* taken by writers around ring updates, so readers can look up entries without the mutex */
+    seqlock_t seqlock;
+    /* woken whenever a write command is committed */
+    wait_queue_head_t readq;
     struct aesd_buffer_entry entry;
+    /* bytes allocated for entry.buffptr while a command is staged */
+    size_t entry_capacity;
+    /* number of write commands completed, reported with AESDCHAR_IOCINFO */
+    uint64_t generation;
+    struct aesd_stats stats;
 };
 
+/**
+ * Per open file state
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    /* set with AESDCHAR_IOCFOLLOW, reads at the end wait for the next entry instead of returning 0 */
+    bool follow;
+    /* position in the stream of all bytes ever written, which evictions do not shift */
+    uint64_t stream_pos;
+};
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
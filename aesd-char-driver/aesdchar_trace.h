@@ -0,0 +1,103 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints of the aesd char driver
+ *
+ *  Enable them with
+ *  echo 1 > /sys/kernel/tracing/events/aesdchar/enable
+ *  and read /sys/kernel/tracing/trace_pipe. Disabled tracepoints cost a
+ *  patched out branch.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/**
+ * At most this many bytes of a command are recorded by aesd_commit
+ */
+#define AESD_TRACE_DATA_MAX 64
+
+TRACE_EVENT(aesd_write,
+
+    TP_PROTO(unsigned int minor, size_t count, size_t staged),
+
+    TP_ARGS(minor, count, staged),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, count)
+        __field(size_t, staged)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->staged = staged;
+    ),
+
+    TP_printk("minor=%u count=%zu staged=%zu", __entry->minor, __entry->count, __entry->staged)
+);
+
+TRACE_EVENT(aesd_commit,
+
+    TP_PROTO(unsigned int minor, const char *data, size_t size, size_t evicted, uint32_t entries),
+
+    TP_ARGS(minor, data, size, evicted, entries),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, size)
+        __field(size_t, evicted)
+        __field(uint32_t, entries)
+        __dynamic_array(char, data, min_t(size_t, size, AESD_TRACE_DATA_MAX))
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->size = size;
+        __entry->evicted = evicted;
+        __entry->entries = entries;
+        memcpy(__get_dynamic_array(data), data, min_t(size_t, size, AESD_TRACE_DATA_MAX));
+    ),
+
+    TP_printk("minor=%u size=%zu evicted=%zu entries=%u data=%.*s", __entry->minor, __entry->size,
+            __entry->evicted, __entry->entries, (int)__get_dynamic_array_len(data), (char *)__get_dynamic_array(data))
+);
+
+TRACE_EVENT(aesd_read,
+
+    TP_PROTO(unsigned int minor, loff_t pos, size_t requested, ssize_t result),
+
+    TP_ARGS(minor, pos, requested, result),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, requested)
+        __field(ssize_t, result)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->requested = requested;
+        __entry->result = result;
+    ),
+
+    TP_printk("minor=%u pos=%lld requested=%zu result=%zd", __entry->minor, __entry->pos,
+            __entry->requested, __entry->result)
+);
+
+#endif /* _AESDCHAR_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
@@ -17,26 +17,49 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 #include "linux/slab.h"
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+static unsigned int aesd_capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(aesd_capacity, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_capacity, "Number of write commands kept for replay");
+static unsigned int aesd_nr_devs = 1;
+module_param(aesd_nr_devs, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of independent devices, each with its own buffer and lock");
 
 MODULE_AUTHOR("kjkuhn"); 
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices;
+static struct dentry *aesd_debugfs_root;
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file;
+
     PDEBUG("open");
-    /**
-     * TODO: handle open
-     */
-    //dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = &aesd_device;
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if(file == NULL)
+        return -ENOMEM;
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    filp->private_data = file;
     
     return 0;
 }
@@ -44,284 +67,1092 @@ int aesd_open(struct inode *inode, struct file *filp)
 int aesd_release(struct inode *inode, struct file *filp)
 {
     PDEBUG("release");
-    /**
-     * TODO: handle release
-     */
-    //nothing todo
+    kfree(filp->private_data);
     return 0;
 }
 
-void print_bytes(const char *msg, char *buffer, size_t offset, size_t nbytes)
+static void aesd_hist_add(atomic64_t *hist, u64 ns)
 {
-    char *out;
+    atomic64_inc(&hist[min_t(unsigned int, fls64(ns), AESD_HIST_BUCKETS - 1)]);
+}
 
-    out = kmalloc(nbytes+1, GFP_KERNEL);
-    if(out)
-    {
-        memcpy(out, &buffer[offset], nbytes);
-        out[nbytes] = 0;
-        PDEBUG("%s %s\n", msg, out);
-        kfree(out);
+/**
+ * Takes the device mutex, recording how long it took
+ * @return the time the mutex was acquired, for aesd_unlock()
+ */
+static u64 aesd_lock(struct aesd_dev *dev)
+{
+    u64 start, locked;
+
+    start = ktime_get_ns();
+    while(mutex_lock_interruptible(&dev->lock));
+    locked = ktime_get_ns();
+    aesd_hist_add(dev->stats.lock_wait, locked - start);
+    return locked;
+}
+
+/**
+ * Releases the device mutex taken at @param locked, recording how long it was held
+ */
+static void aesd_unlock(struct aesd_dev *dev, u64 locked)
+{
+    aesd_hist_add(dev->stats.lock_hold, ktime_get_ns() - locked);
+    mutex_unlock(&dev->lock);
+}
+
+/**
+ * Entry storage comes from one slab cache per power of two size class, from AESD_BLOB_MIN_SIZE
+ * bytes including the header up to AESD_BLOB_MIN_SIZE << (AESD_BLOB_CLASSES - 1). Freed blobs
+ * go back to their cache for the next write of that size, larger ones use kmalloc.
+ */
+#define AESD_BLOB_CLASSES 7
+#define AESD_BLOB_MIN_SIZE 64
+
+static struct kmem_cache *aesd_blob_cache[AESD_BLOB_CLASSES];
+static char aesd_blob_cache_name[AESD_BLOB_CLASSES][24];
+/* per class allocation counters, the last slot counts kmalloc fallbacks */
+static atomic64_t aesd_blob_allocs[AESD_BLOB_CLASSES + 1];
+static atomic64_t aesd_blob_frees[AESD_BLOB_CLASSES + 1];
+
+static size_t aesd_blob_class_size(unsigned int class)
+{
+    return (size_t)AESD_BLOB_MIN_SIZE << class;
+}
+
+/**
+ * @return the class serving a blob of @param size bytes including the header, AESD_BLOB_CLASSES
+ * if it is too large for the caches
+ */
+static unsigned int aesd_blob_class(size_t size)
+{
+    unsigned int class;
+
+    for(class = 0; class < AESD_BLOB_CLASSES && size > aesd_blob_class_size(class); class++);
+    return class;
+}
+
+/**
+ * Allocates a blob for at least @param capacity bytes of data
+ * @param usable set to the number of data bytes the blob can hold
+ */
+static struct aesd_blob *aesd_blob_alloc(size_t capacity, size_t *usable)
+{
+    struct aesd_blob *blob;
+    unsigned int class;
+    size_t size;
+
+    class = aesd_blob_class(sizeof(struct aesd_blob) + capacity);
+    if(class < AESD_BLOB_CLASSES) {
+        size = aesd_blob_class_size(class);
+        blob = kmem_cache_alloc(aesd_blob_cache[class], GFP_KERNEL);
+    } else {
+        size = sizeof(struct aesd_blob) + capacity;
+        blob = kmalloc(size, GFP_KERNEL);
     }
+    if(blob == NULL)
+        return NULL;
+    blob->class = class;
+    *usable = size - sizeof(struct aesd_blob);
+    atomic64_inc(&aesd_blob_allocs[class]);
+    return blob;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static void aesd_blob_free(struct aesd_blob *blob)
+{
+    atomic64_inc(&aesd_blob_frees[blob->class]);
+    if(blob->class < AESD_BLOB_CLASSES)
+        kmem_cache_free(aesd_blob_cache[blob->class], blob);
+    else
+        kfree(blob);
+}
+
+static void aesd_blob_free_rcu(struct rcu_head *rcu)
+{
+    aesd_blob_free(container_of(rcu, struct aesd_blob, rcu));
+}
+
+/**
+ * Drops a reference to the entry data at @param buffptr. Readers may still be looking at it
+ * under rcu_read_lock, so the memory is freed after a grace period.
+ */
+static void aesd_blob_put(const char *buffptr)
+{
+    struct aesd_blob *blob = aesd_blob_of(buffptr);
+
+    if(refcount_dec_and_test(&blob->refs))
+        call_rcu(&blob->rcu, aesd_blob_free_rcu);
+}
+
+static void aesd_blob_destroy_caches(void)
+{
+    unsigned int class;
+
+    for(class = 0; class < AESD_BLOB_CLASSES; class++) {
+        kmem_cache_destroy(aesd_blob_cache[class]);
+        aesd_blob_cache[class] = NULL;
+    }
+}
+
+static int aesd_blob_create_caches(void)
+{
+    unsigned int class;
+    size_t size;
+
+    for(class = 0; class < AESD_BLOB_CLASSES; class++) {
+        size = aesd_blob_class_size(class);
+        snprintf(aesd_blob_cache_name[class], sizeof(aesd_blob_cache_name[class]), "aesd_blob_%zu", size);
+        // Only the data is copied to and from user space, whitelist it for hardened usercopy
+        aesd_blob_cache[class] = kmem_cache_create_usercopy(aesd_blob_cache_name[class], size, 0, 0,
+                offsetof(struct aesd_blob, data), size - offsetof(struct aesd_blob, data), NULL);
+        if(aesd_blob_cache[class] == NULL) {
+            aesd_blob_destroy_caches();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return true if a read on @param filp would return data right away
+ */
+static bool aesd_readable(struct file *filp)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    unsigned int seq;
+    bool readable;
+
+    do {
+        seq = read_seqbegin(&dev->seqlock);
+        if(file->follow)
+            readable = file->stream_pos < dev->circular_buf.base + dev->circular_buf.total_size;
+        else
+            readable = filp->f_pos < dev->circular_buf.total_size;
+    } while(read_seqretry(&dev->seqlock, seq));
+    return readable;
+}
+
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t retval;
-    /**
-     * TODO: handle read
-     */
     struct aesd_buffer_entry *entry;
+    const char *buffptr;
     size_t offset;
+    size_t size;
     size_t bytes_to_read;
+    size_t copied;
+    loff_t pos;
+    uint64_t stream_pos;
+    struct file *filp;
+    struct aesd_file *file;
     struct aesd_dev *dev;
+    struct aesd_blob *blob;
+    unsigned int seq;
+    size_t requested;
+    loff_t start;
 
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    PDEBUG("read %zu bytes with offset %lld",iov_iter_count(to),iocb->ki_pos);
 
-    offset = 0;
     retval = 0;
-    entry = NULL;
 
-    dev = filp->private_data;
+    filp = iocb->ki_filp;
+    file = filp->private_data;
+    dev = file->dev;
+    requested = iov_iter_count(to);
+    start = iocb->ki_pos;
 
-    while(mutex_lock_interruptible(&dev->lock));
+    // Readers take no lock: each entry is looked up under the seqlock and pinned with a
+    // reference, so the copy can sleep without holding up writers or other readers
+    while(iov_iter_count(to) > 0)
+    {
+        rcu_read_lock();
+        do {
+            seq = read_seqbegin(&dev->seqlock);
+            buffptr = NULL;
+            size = 0;
+            offset = 0;
+            pos = iocb->ki_pos;
+            if(file->follow) {
+                // Followers keep their place in the stream, evictions shift the file position.
+                // Entries evicted before they were read are skipped.
+                pos = file->stream_pos > dev->circular_buf.base ? file->stream_pos - dev->circular_buf.base : 0;
+            }
+            stream_pos = dev->circular_buf.base + pos;
+            // Find the entry in the circular buffer corresponding to the current file position
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circular_buf, pos, &offset);
+            if(entry != NULL) {
+                buffptr = entry->buffptr;
+                size = entry->size;
+            }
+        } while(read_seqretry(&dev->seqlock, seq));
+        blob = NULL;
+        if(buffptr != NULL) {
+            blob = aesd_blob_of(buffptr);
+            if(!refcount_inc_not_zero(&blob->refs))
+                blob = NULL;
+        }
+        rcu_read_unlock();
 
-    // Find the entry in the circular buffer corresponding to the current file position
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circular_buf, *f_pos, &offset);
-    if(entry == NULL) {
-        // Reached the end of the buffer. For this assignment, we don't read beyond the buffer
-        PDEBUG("Nothing to read, returning 0\n");
-        goto out;
-    }
+        if(buffptr == NULL) {
+            // Reached the end of the buffer. Followers wait for the next entry, everyone else
+            // gets what was read so far or end of file
+            if(retval > 0 || !file->follow) {
+                PDEBUG("Nothing to read, returning %zd\n", retval);
+                break;
+            }
+            if((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+                retval = -EAGAIN;
+                break;
+            }
+            if(wait_event_interruptible(dev->readq, aesd_readable(filp))) {
+                retval = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+        if(blob == NULL) {
+            // Evicted right after the lookup, look the position up again
+            continue;
+        }
 
-    // Calculate how many bytes can be read from the current entry
-    bytes_to_read = min(count, entry->size - offset);
+        bytes_to_read = min(iov_iter_count(to), size - offset);
 
-    // Copy data from the kernel buffer to the user buffer
-    if (copy_to_user(buf, entry->buffptr + offset, bytes_to_read) != 0) {
-        retval = -EFAULT;
-        goto out;
-    }
+        // Copy data from the kernel buffer to the user buffer, a pipe for splice or a kernel
+        // buffer, whatever the iterator describes
+        copied = copy_to_iter(buffptr + offset, bytes_to_read, to);
+        PDEBUG("returned %zu bytes to user from addr %p (orig %p, off %zu)\n", copied, &buffptr[offset], buffptr, offset);
+        aesd_blob_put(buffptr);
 
-    retval = bytes_to_read;
-    *f_pos += bytes_to_read;
-    PDEBUG("returned %ld bytes to user from addr %p (orig %p, off %lu)\n", retval, &entry->buffptr[offset], entry->buffptr, offset);
-    print_bytes("returning: ", entry->buffptr, offset, bytes_to_read);
+        retval += copied;
+        iocb->ki_pos = pos + copied;
+        file->stream_pos = stream_pos + copied;
+        if(copied < bytes_to_read) {
+            // Report what was copied so far, fail only if nothing was
+            if(retval == 0)
+                retval = -EFAULT;
+            break;
+        }
+    }
 
-out:
-    mutex_unlock(&dev->lock);
+    atomic64_inc(&dev->stats.reads);
+    if(retval > 0)
+        atomic64_add(retval, &dev->stats.bytes_read);
+    trace_aesd_read(MINOR(dev->cdev.dev), start, requested, retval);
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
     ssize_t retval;
+    size_t count;
     struct aesd_dev *dev;
-    int i;
-    char *buffer;
+    struct aesd_blob *blob;
+    struct aesd_blob *staged;
+    const char *evicted;
+    size_t capacity;
+    uint64_t held;
+    u64 locked;
 
     retval = -ENOMEM;
 
-    dev = filp->private_data;
-    while(mutex_lock_interruptible(&dev->lock));
-
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+    count = iov_iter_count(from);
+    dev = ((struct aesd_file *)iocb->ki_filp->private_data)->dev;
+    locked = aesd_lock(dev);
 
-    // TODO: handle write
-    // Allocate kernel buffer to copy data from user space
-    buffer = kmalloc(dev->entry.size + count, GFP_KERNEL);
+    PDEBUG("write %zu bytes with offset %lld",count,iocb->ki_pos);
+    trace_aesd_write(MINOR(dev->cdev.dev), count, dev->entry.size);
 
-    if(buffer == NULL){
-        // Memory allocation failed
-        goto out;
-    }
-    if(dev->entry.size > 0)
+    // Grow the staging buffer geometrically, so a command streamed in small writes
+    // is copied a constant number of times per byte instead of once per write
+    if(dev->entry.size + count > dev->entry_capacity)
     {
-        memcpy(buffer, dev->entry.buffptr, dev->entry.size);
-        kfree(dev->entry.buffptr);
+        blob = aesd_blob_alloc(max(dev->entry_capacity * 2, dev->entry.size + count), &capacity);
+        if(blob == NULL){
+            // Memory allocation failed, the staged data is kept
+            goto out;
+        }
+        if(dev->entry.buffptr != NULL)
+        {
+            memcpy(blob->data, dev->entry.buffptr, dev->entry.size);
+            aesd_blob_free(aesd_blob_of(dev->entry.buffptr));
+        }
+        dev->entry.buffptr = blob->data;
+        dev->entry_capacity = capacity;
     }
 
-    // Copy data from user space to kernel space
-    if(copy_from_user(&buffer[dev->entry.size], buf, count)){
+    // Copy data from user space to kernel space, all segments of a writev land in the same command
+    if(copy_from_iter((char *)&dev->entry.buffptr[dev->entry.size], count, from) != count){
         // Copy failed
         retval = -EFAULT;
-        goto out_with_kfree;
+        goto out;
     }
-
-    // Prepare the entry for the circular buffer
-    dev->entry.buffptr = buffer;
     dev->entry.size += count;
 
     // Add the entry to the circular buffer
     if(dev->entry.buffptr[dev->entry.size-1] == '\n')
     {
-        buffer = (char*) aesd_circular_buffer_add_entry(&dev->circular_buf, &dev->entry);
+        // Give back the slack of the staging buffer before it is kept for replay, when the
+        // command fits a smaller class or sits in an oversized kmalloc block
+        blob = aesd_blob_of(dev->entry.buffptr);
+        if(dev->entry_capacity > dev->entry.size &&
+            (blob->class == AESD_BLOB_CLASSES ||
+             aesd_blob_class(sizeof(struct aesd_blob) + dev->entry.size) < blob->class))
+        {
+            staged = blob;
+            blob = aesd_blob_alloc(dev->entry.size, &capacity);
+            if(blob != NULL)
+            {
+                memcpy(blob->data, staged->data, dev->entry.size);
+                aesd_blob_free(staged);
+                dev->entry.buffptr = blob->data;
+            }
+            blob = aesd_blob_of(dev->entry.buffptr);
+        }
+        // The buffer holds the only reference until readers pin the entry
+        refcount_set(&blob->refs, 1);
+        held = aesd_size(&dev->circular_buf) + dev->entry.size;
+        write_seqlock(&dev->seqlock);
+        evicted = aesd_circular_buffer_add_entry(&dev->circular_buf, &dev->entry);
+        write_sequnlock(&dev->seqlock);
+        trace_aesd_commit(MINOR(dev->cdev.dev), dev->entry.buffptr, dev->entry.size,
+                held - aesd_size(&dev->circular_buf), aesd_circular_buffer_count(&dev->circular_buf));
         memset(&dev->entry, 0, sizeof(struct aesd_buffer_entry));
-        if(buffer != 0)
-            kfree(buffer);
-    }
-    // print values
-    for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
-    {
-        PDEBUG("%d: at %p, length %lu\n", i, dev->circular_buf.entry[i].buffptr, dev->circular_buf.entry[i].size);
-        print_bytes("content: ", dev->circular_buf.entry[i].buffptr, 0, dev->circular_buf.entry[i].size);
+        dev->entry_capacity = 0;
+        dev->generation++;
+        if(evicted != NULL) {
+            atomic64_inc(&dev->stats.evictions);
+            aesd_blob_put(evicted);
+        }
+        wake_up_interruptible(&dev->readq);
     }
 
     retval = count; // Success, all bytes written
-    *f_pos = aesd_size(&dev->circular_buf);
-    goto out;
+    iocb->ki_pos = aesd_size(&dev->circular_buf);
+    atomic64_inc(&dev->stats.writes);
+    atomic64_add(count, &dev->stats.bytes_written);
 
-out_with_kfree:
-    kfree(buffer);
 out:
-    mutex_unlock(&dev->lock);
+    aesd_unlock(dev, locked);
     return retval;
 }
 
 
+/**
+ * Copies whole commands starting at range.write_cmd, range.write_cmd_offset into the user buffer
+ * and their lengths into the user length array, all under one acquisition of the device mutex.
+ */
+static long aesd_ioctl_range(struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_range range;
+    struct aesd_buffer_entry *entry;
+    char __user *buf;
+    uint64_t __user *lengths;
+    uint64_t len, copied;
+    uint32_t n, count;
+    size_t offset;
+    long result;
+    u64 locked;
+
+    if(copy_from_user(&range, (const void __user*)arg, sizeof(range)))
+        return -EFAULT;
+    buf = u64_to_user_ptr(range.buf);
+    lengths = u64_to_user_ptr(range.lengths);
+    result = 0;
+    copied = 0;
+    n = 0;
+
+    locked = aesd_lock(dev);
+    count = aesd_circular_buffer_count(&dev->circular_buf);
+    if(range.write_cmd >= count ||
+        aesd_circular_buffer_nth(&dev->circular_buf, range.write_cmd)->size < range.write_cmd_offset)
+    {
+        result = -EINVAL;
+        goto out;
+    }
+    offset = range.write_cmd_offset;
+    for(; n < range.cmd_count && n < count - range.write_cmd; n++)
+    {
+        entry = aesd_circular_buffer_nth(&dev->circular_buf, range.write_cmd + n);
+        len = entry->size - offset;
+        if(copied + len > range.buf_size)
+        {
+            // Only whole commands are copied, tell the caller how much the first one needs
+            if(n == 0)
+                result = put_user(len, &lengths[0]) ? -EFAULT : -ENOSPC;
+            break;
+        }
+        if(copy_to_user(buf + copied, entry->buffptr + offset, len) || put_user(len, &lengths[n]))
+        {
+            result = -EFAULT;
+            break;
+        }
+        copied += len;
+        offset = 0;
+    }
+
+out:
+    aesd_unlock(dev, locked);
+    atomic64_inc(&dev->stats.reads);
+    atomic64_add(copied, &dev->stats.bytes_read);
+    if(result == 0)
+    {
+        range.cmd_count = n;
+        range.bytes = copied;
+        if(copy_to_user((void __user*)arg, &range, sizeof(range)))
+            result = -EFAULT;
+    }
+    return result;
+}
+
+/**
+ * Reports the offset and size of every command held. The table is built under the device mutex
+ * and copied out after it is dropped, so it is consistent with the generation reported.
+ */
+static long aesd_ioctl_index(struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_index index;
+    struct aesd_index_entry *table;
+    uint32_t n, max;
+    long result;
+    u64 locked;
+
+    if(copy_from_user(&index, (const void __user*)arg, sizeof(index)))
+        return -EFAULT;
+    table = NULL;
+    // the ring never holds more than capacity commands, so allocate before taking the lock
+    max = min(index.max_entries, dev->circular_buf.capacity);
+    if(max > 0)
+    {
+        table = kvmalloc_array(max, sizeof(*table), GFP_KERNEL);
+        if(!table)
+            return -ENOMEM;
+    }
+
+    locked = aesd_lock(dev);
+    index.count = aesd_circular_buffer_count(&dev->circular_buf);
+    index.info.size = aesd_size(&dev->circular_buf);
+    index.info.generation = dev->generation;
+    result = index.count > max ? -ENOSPC : 0;
+    for(n = 0; result == 0 && n < index.count; n++)
+    {
+        table[n].write_cmd = n;
+        table[n].reserved = 0;
+        table[n].offset = dev->circular_buf.entry_start[(dev->circular_buf.out_offs + n) & dev->circular_buf.mask]
+                - dev->circular_buf.base;
+        table[n].size = aesd_circular_buffer_nth(&dev->circular_buf, n)->size;
+    }
+    aesd_unlock(dev, locked);
+
+    // on ENOSPC the header still goes back, count tells the caller how large an array to pass
+    if(result == 0 && index.count > 0 &&
+        copy_to_user(u64_to_user_ptr(index.entries), table, index.count * sizeof(*table)))
+        result = -EFAULT;
+    if(result != -EFAULT && copy_to_user((void __user*)arg, &index, sizeof(index)))
+        result = -EFAULT;
+    kvfree(table);
+    return result;
+}
+
+/**
+ * Writes an image of all commands held to the user buffer, see struct aesd_image_header
+ */
+static long aesd_ioctl_save(struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_image image;
+    struct aesd_image_header hdr;
+    struct aesd_buffer_entry *entry;
+    char __user *buf;
+    uint64_t __user *sizes;
+    char __user *data;
+    uint32_t n;
+    long result;
+    u64 locked;
+
+    if(copy_from_user(&image, (const void __user*)arg, sizeof(image)))
+        return -EFAULT;
+    buf = u64_to_user_ptr(image.buf);
+    result = 0;
+
+    locked = aesd_lock(dev);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = AESD_IMAGE_MAGIC;
+    hdr.version = AESD_IMAGE_VERSION;
+    hdr.count = aesd_circular_buffer_count(&dev->circular_buf);
+    hdr.info.size = aesd_size(&dev->circular_buf);
+    hdr.info.generation = dev->generation;
+    image.bytes = sizeof(hdr) + (uint64_t)hdr.count * sizeof(uint64_t) + hdr.info.size;
+    if(image.buf_size < image.bytes)
+    {
+        result = -ENOSPC;
+        goto out;
+    }
+    if(copy_to_user(buf, &hdr, sizeof(hdr)))
+    {
+        result = -EFAULT;
+        goto out;
+    }
+    sizes = (uint64_t __user *)(buf + sizeof(hdr));
+    data = buf + sizeof(hdr) + (uint64_t)hdr.count * sizeof(uint64_t);
+    for(n = 0; n < hdr.count; n++)
+    {
+        entry = aesd_circular_buffer_nth(&dev->circular_buf, n);
+        if(put_user((uint64_t)entry->size, &sizes[n]) || copy_to_user(data, entry->buffptr, entry->size))
+        {
+            result = -EFAULT;
+            goto out;
+        }
+        data += entry->size;
+    }
+
+out:
+    aesd_unlock(dev, locked);
+    if(result != -EFAULT && copy_to_user((void __user*)arg, &image, sizeof(image)))
+        result = -EFAULT;
+    return result;
+}
+
+/**
+ * Appends the commands of an image saved with aesd_ioctl_save. All of them are copied into new
+ * entries before the device mutex is taken, then added to the ring in one seqlock write section.
+ * Commands the ring has no room for are skipped from the oldest end, as writes would evict them.
+ */
+static long aesd_ioctl_restore(struct aesd_dev *dev, unsigned long arg)
+{
+    struct aesd_image image;
+    struct aesd_image_header hdr;
+    struct aesd_buffer_entry entry;
+    struct aesd_blob *blob;
+    const char __user *buf;
+    const char __user *data;
+    uint64_t *sizes;
+    const char **entries;
+    uint64_t index_bytes, total;
+    uint32_t n, count, copied, evictions;
+    size_t usable;
+    long result;
+    u64 locked;
+
+    if(copy_from_user(&image, (const void __user*)arg, sizeof(image)))
+        return -EFAULT;
+    buf = u64_to_user_ptr(image.buf);
+    if(image.buf_size < sizeof(hdr))
+        return -EINVAL;
+    if(copy_from_user(&hdr, buf, sizeof(hdr)))
+        return -EFAULT;
+    index_bytes = (uint64_t)hdr.count * sizeof(uint64_t);
+    if(hdr.magic != AESD_IMAGE_MAGIC || hdr.version != AESD_IMAGE_VERSION ||
+        image.buf_size - sizeof(hdr) < index_bytes ||
+        image.buf_size - sizeof(hdr) - index_bytes < hdr.info.size)
+        return -EINVAL;
+    // Only the newest commands that fit the ring are read, so the allocations are bounded by
+    // the capacity and not by the image
+    count = min(hdr.count, dev->circular_buf.capacity);
+    if(count == 0)
+        return 0;
+
+    entries = NULL;
+    copied = 0;
+    sizes = kvmalloc_array(count, sizeof(*sizes), GFP_KERNEL);
+    entries = kvmalloc_array(count, sizeof(*entries), GFP_KERNEL);
+    if(!sizes || !entries)
+    {
+        result = -ENOMEM;
+        goto out;
+    }
+    if(copy_from_user(sizes, buf + sizeof(hdr) + index_bytes - count * sizeof(*sizes), count * sizeof(*sizes)))
+    {
+        result = -EFAULT;
+        goto out;
+    }
+    // Commands are never empty and cannot add up to more than the size in the header
+    total = 0;
+    for(n = 0; n < count; n++)
+    {
+        if(sizes[n] == 0 || sizes[n] > hdr.info.size - total)
+        {
+            result = -EINVAL;
+            goto out;
+        }
+        total += sizes[n];
+    }
+
+    // The contents of the kept commands are the last total bytes of the image
+    data = buf + sizeof(hdr) + index_bytes + hdr.info.size - total;
+    for(; copied < count; copied++)
+    {
+        blob = aesd_blob_alloc(sizes[copied], &usable);
+        if(blob == NULL)
+        {
+            result = -ENOMEM;
+            goto out;
+        }
+        if(copy_from_user(blob->data, data, sizes[copied]))
+        {
+            aesd_blob_free(blob);
+            result = -EFAULT;
+            goto out;
+        }
+        refcount_set(&blob->refs, 1);
+        entries[copied] = blob->data;
+        data += sizes[copied];
+    }
+
+    // Each slot of entries is handed to the ring and takes back what the ring evicted instead
+    evictions = 0;
+    locked = aesd_lock(dev);
+    write_seqlock(&dev->seqlock);
+    for(n = 0; n < count; n++)
+    {
+        entry.buffptr = entries[n];
+        entry.size = sizes[n];
+        entries[n] = aesd_circular_buffer_add_entry(&dev->circular_buf, &entry);
+        evictions += entries[n] != NULL;
+    }
+    write_sequnlock(&dev->seqlock);
+    // A restore into a fresh device carries on from the saved change count
+    dev->generation = max(dev->generation + count, hdr.info.generation);
+    aesd_unlock(dev, locked);
+    PDEBUG("restored %u of %u commands", count, hdr.count);
+
+    atomic64_add(count, &dev->stats.writes);
+    atomic64_add(total, &dev->stats.bytes_written);
+    atomic64_add(evictions, &dev->stats.evictions);
+    for(n = 0; n < count; n++)
+    {
+        if(entries[n] != NULL)
+            aesd_blob_put(entries[n]);
+    }
+    copied = 0;
+    wake_up_interruptible(&dev->readq);
+    result = 0;
+
+out:
+    // On failure only the entries copied so far are left to free
+    for(n = 0; n < copied; n++)
+        aesd_blob_free(aesd_blob_of(entries[n]));
+    kvfree(entries);
+    kvfree(sizes);
+    return result;
+}
+
 long aesd_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 {
     int64_t result;
     struct aesd_seekto as;
+    struct aesd_info info;
+    struct aesd_file *file;
     struct aesd_dev *dev;
-    uint8_t idx;
-    uint64_t total_size;
-    uint32_t counter;
+    struct aesd_buffer_entry *entry;
+    u64 locked;
 
     result = -EINVAL;
-    dev = fp->private_data;
-    total_size = 0;
-    counter = 0;
+    file = fp->private_data;
+    dev = file->dev;
+
+    if(_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR)
+        return -ENOTTY;
 
     if(cmd == AESDCHAR_IOCSEEKTO && 
-        copy_from_user(&as, (const void __user*)arg, sizeof(as)) == 0 &&
-        ((dev->circular_buf.full && dev->circular_buf.in_offs == dev->circular_buf.out_offs) ||
-        dev->circular_buf.in_offs != dev->circular_buf.out_offs)
-    )
+        copy_from_user(&as, (const void __user*)arg, sizeof(as)) == 0)
     {
         PDEBUG("running aesd_ioctl with %u,%u\n", as.write_cmd, as.write_cmd_offset);
-        while(mutex_lock_interruptible(&dev->lock));
-        idx = dev->circular_buf.out_offs;
-        do
+        locked = aesd_lock(dev);
+        if(as.write_cmd < aesd_circular_buffer_count(&dev->circular_buf))
         {
-            PDEBUG("counter is %u, as.write_cmd is %u\n", counter, as.write_cmd);
-            if(counter == as.write_cmd)
+            entry = aesd_circular_buffer_nth(&dev->circular_buf, as.write_cmd);
+            if(entry->size >= as.write_cmd_offset)
             {
-                PDEBUG("counter = as.write_cmd = %u\n", counter);
-                if(dev->circular_buf.entry[idx].size >= as.write_cmd_offset)
-                {
-                    fp->f_pos = total_size + as.write_cmd_offset;
-                    PDEBUG("f_pos = %lu\n", fp->f_pos);
-                    result = 0;
-                }
-                break;
+                fp->f_pos = dev->circular_buf.entry_start[(dev->circular_buf.out_offs + as.write_cmd) & dev->circular_buf.mask]
+                        - dev->circular_buf.base + as.write_cmd_offset;
+                file->stream_pos = dev->circular_buf.base + fp->f_pos;
+                PDEBUG("f_pos = %lld\n", fp->f_pos);
+                result = 0;
             }
-            total_size += dev->circular_buf.entry[idx].size;
-            idx = (idx + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-            counter++;
-        } while(idx != dev->circular_buf.in_offs);  
-        mutex_unlock(&dev->lock);
+        }
+        aesd_unlock(dev, locked);
+    }
+    else if(cmd == AESDCHAR_IOCINFO)
+    {
+        locked = aesd_lock(dev);
+        info.size = aesd_size(&dev->circular_buf);
+        info.generation = dev->generation;
+        aesd_unlock(dev, locked);
+        result = copy_to_user((void __user*)arg, &info, sizeof(info)) ? -EFAULT : 0;
+    }
+    else if(cmd == AESDCHAR_IOCFOLLOW)
+    {
+        locked = aesd_lock(dev);
+        file->follow = arg != 0;
+        file->stream_pos = dev->circular_buf.base + fp->f_pos;
+        aesd_unlock(dev, locked);
+        result = 0;
+    }
+    else if(cmd == AESDCHAR_IOCRANGE)
+    {
+        result = aesd_ioctl_range(dev, arg);
+    }
+    else if(cmd == AESDCHAR_IOCINDEX)
+    {
+        result = aesd_ioctl_index(dev, arg);
+    }
+    else if(cmd == AESDCHAR_IOCSAVE)
+    {
+        result = aesd_ioctl_save(dev, arg);
+    }
+    else if(cmd == AESDCHAR_IOCRESTORE)
+    {
+        result = (fp->f_mode & FMODE_WRITE) ? aesd_ioctl_restore(dev, arg) : -EBADF;
     }
     return result;
 }
 
+/**
+ * A copy of the device contents backing one or more mappings, freed with the last of them
+ */
+struct aesd_snapshot {
+    struct kref ref;
+    void *data;
+};
+
+static void aesd_snapshot_release(struct kref *ref)
+{
+    struct aesd_snapshot *snap = container_of(ref, struct aesd_snapshot, ref);
+
+    vfree(snap->data);
+    kfree(snap);
+}
+
+static void aesd_vma_open(struct vm_area_struct *vma)
+{
+    struct aesd_snapshot *snap = vma->vm_private_data;
+
+    kref_get(&snap->ref);
+}
+
+static void aesd_vma_close(struct vm_area_struct *vma)
+{
+    struct aesd_snapshot *snap = vma->vm_private_data;
+
+    kref_put(&snap->ref, aesd_snapshot_release);
+}
+
+static const struct vm_operations_struct aesd_vm_ops = {
+    .open =     aesd_vma_open,
+    .close =    aesd_vma_close,
+};
+
+/**
+ * Maps a read-only snapshot of the device. The mapping starts with a struct aesd_info
+ * describing the snapshot, followed by the contents. Contents longer than the mapping
+ * are cut off, so readers must clamp info.size to the mapping length.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev;
+    struct aesd_snapshot *snap;
+    struct aesd_info *info;
+    struct aesd_buffer_entry *entry;
+    unsigned long len;
+    size_t pos, bytes;
+    uint32_t n;
+    int result;
+    u64 locked;
+
+    dev = ((struct aesd_file *)filp->private_data)->dev;
+    len = vma->vm_end - vma->vm_start;
+
+    if(vma->vm_pgoff != 0)
+        return -EINVAL;
+    if(vma->vm_flags & VM_WRITE)
+        return -EACCES;
+    // The snapshot is read only for good, mprotect must not make it writable later
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    // Any user who can open the device may map it, so the snapshot is not allowed to
+    // grow beyond what the contents need
+    locked = aesd_lock(dev);
+    bytes = aesd_size(&dev->circular_buf);
+    aesd_unlock(dev, locked);
+    if(len > PAGE_ALIGN(sizeof(*info) + bytes))
+        return -EINVAL;
+
+    snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+    if(snap == NULL)
+        return -ENOMEM;
+    kref_init(&snap->ref);
+    // vmalloc_user memory is zeroed and page backed, so it can be mapped page by page
+    snap->data = vmalloc_user(len);
+    if(snap->data == NULL) {
+        kfree(snap);
+        return -ENOMEM;
+    }
+
+    info = snap->data;
+    pos = sizeof(*info);
+    locked = aesd_lock(dev);
+    info->size = aesd_size(&dev->circular_buf);
+    info->generation = dev->generation;
+    for(n = 0; n < aesd_circular_buffer_count(&dev->circular_buf) && pos < len; n++)
+    {
+        entry = aesd_circular_buffer_nth(&dev->circular_buf, n);
+        bytes = min(entry->size, len - pos);
+        memcpy(snap->data + pos, entry->buffptr, bytes);
+        pos += bytes;
+    }
+    aesd_unlock(dev, locked);
+    PDEBUG("mmap %lu bytes, snapshot of %llu bytes\n", len, info->size);
+
+    result = remap_vmalloc_range(vma, snap->data, 0);
+    if(result) {
+        kref_put(&snap->ref, aesd_snapshot_release);
+        return result;
+    }
+    vma->vm_private_data = snap;
+    vma->vm_ops = &aesd_vm_ops;
+    return 0;
+}
+
 loff_t aesd_seek(struct file *fp, loff_t offset, int whence)
 {
+    struct aesd_file *file;
     struct aesd_dev *dev;
     loff_t result;
+    u64 locked;
 
-    dev = fp->private_data;
+    file = fp->private_data;
+    dev = file->dev;
 
-    while(mutex_lock_interruptible(&dev->lock));
+    locked = aesd_lock(dev);
     result = fixed_size_llseek(fp, offset, whence, aesd_size(&dev->circular_buf));
-    mutex_unlock(&dev->lock);
+    if(result >= 0)
+        file->stream_pos = dev->circular_buf.base + result;
+    aesd_unlock(dev, locked);
     
     return result;
 }
 
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_dev *dev;
+    __poll_t mask;
+
+    dev = ((struct aesd_file *)filp->private_data)->dev;
+
+    poll_wait(filp, &dev->readq, wait);
+    // Writes never wait for readers
+    mask = EPOLLOUT | EPOLLWRNORM;
+    if(aesd_readable(filp))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter =    aesd_read_iter,
+    .write_iter =   aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read =  copy_splice_read,
+#else
+    .splice_read =  generic_file_splice_read,
+#endif
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_seek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static void aesd_show_hist(struct seq_file *m, const char *name, atomic64_t *hist)
+{
+    unsigned int b;
+    s64 n;
+
+    seq_printf(m, "%s:\n", name);
+    for(b = 0; b < AESD_HIST_BUCKETS; b++) {
+        n = atomic64_read(&hist[b]);
+        if(n > 0)
+            seq_printf(m, "  < %llu ns: %lld\n", 1ULL << b, n);
+    }
+}
+
+static int aesd_stats_show(struct seq_file *m, void *v)
+{
+    struct aesd_dev *dev = m->private;
+    unsigned int seq;
+    uint32_t entries;
+    uint64_t bytes;
+
+    do {
+        seq = read_seqbegin(&dev->seqlock);
+        entries = aesd_circular_buffer_count(&dev->circular_buf);
+        bytes = aesd_size(&dev->circular_buf);
+    } while(read_seqretry(&dev->seqlock, seq));
+
+    seq_printf(m, "entries: %u\ncapacity: %u\nbytes: %llu\n", entries, dev->circular_buf.capacity, bytes);
+    seq_printf(m, "evictions: %lld\nreads: %lld\nwrites: %lld\nbytes_read: %lld\nbytes_written: %lld\n",
+            atomic64_read(&dev->stats.evictions), atomic64_read(&dev->stats.reads),
+            atomic64_read(&dev->stats.writes), atomic64_read(&dev->stats.bytes_read),
+            atomic64_read(&dev->stats.bytes_written));
+    aesd_show_hist(m, "lock_wait", dev->stats.lock_wait);
+    aesd_show_hist(m, "lock_hold", dev->stats.lock_hold);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static int aesd_blobs_show(struct seq_file *m, void *v)
+{
+    unsigned int i;
+
+    for(i = 0; i <= AESD_BLOB_CLASSES; i++) {
+        seq_printf(m, "%s: %lld allocated, %lld freed\n",
+                i < AESD_BLOB_CLASSES ? aesd_blob_cache_name[i] : "kmalloc",
+                atomic64_read(&aesd_blob_allocs[i]), atomic64_read(&aesd_blob_frees[i]));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_blobs);
+
+/**
+ * Creates /sys/kernel/debug/aesdchar with the allocator counters and a stats file per device.
+ * debugfs failures are not fatal, the driver works without it.
+ */
+static void aesd_debugfs_init(void)
+{
+    struct dentry *dir;
+    char name[16];
+    unsigned int i;
+
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+    debugfs_create_file("blobs", 0444, aesd_debugfs_root, NULL, &aesd_blobs_fops);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        snprintf(name, sizeof(name), "aesdchar%u", i);
+        dir = debugfs_create_dir(name, aesd_debugfs_root);
+        debugfs_create_file("stats", 0444, dir, &aesd_devices[i], &aesd_stats_fops);
+    }
+}
+
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     }
     return err;
 }
 
+/**
+ * Frees the entries, the ring and any partial command of one device
+ */
+static void aesd_free_device(struct aesd_dev *dev)
+{
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
 
+    // Free the memory allocated for each buffer entry
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->circular_buf, index)
+    {
+        if (entry->buffptr) {
+            aesd_blob_free(aesd_blob_of(entry->buffptr));
+        }
+    }
+    aesd_circular_buffer_free(&dev->circular_buf);
+    // Free a partial command that never got its newline
+    if (dev->entry.buffptr) {
+        aesd_blob_free(aesd_blob_of(dev->entry.buffptr));
+    }
+}
 
 int aesd_init_module(void)
 {
     dev_t dev;
     int result;
+    unsigned int i;
 
+    if (aesd_nr_devs == 0) {
+        return -EINVAL;
+    }
     dev = 0;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
+    result = aesd_blob_create_caches();
+    if (result) {
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return result;
+    }
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (aesd_devices == NULL) {
+        aesd_blob_destroy_caches();
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return -ENOMEM;
+    }
 
-    /**
-     * TODO: initialize the AESD specific portion of the device
-     */
+    for (i = 0; i < aesd_nr_devs; i++) {
+        //init buffer
+        result = aesd_circular_buffer_init_capacity(&aesd_devices[i].circular_buf, aesd_capacity);
+        if( result ) {
+            printk(KERN_WARNING "Can't allocate %u entries\n", aesd_capacity);
+            goto fail;
+        }
+        mutex_init(&aesd_devices[i].lock);
+        seqlock_init(&aesd_devices[i].seqlock);
+        init_waitqueue_head(&aesd_devices[i].readq);
 
-    //init buffer
-    aesd_circular_buffer_init(&aesd_device.circular_buf);
-    mutex_init(&aesd_device.lock);
+        result = aesd_setup_cdev(&aesd_devices[i], i);
+        if( result ) {
+            aesd_free_device(&aesd_devices[i]);
+            goto fail;
+        }
+    }
+    aesd_debugfs_init();
+    return 0;
 
-    result = aesd_setup_cdev(&aesd_device);
-    
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+fail:
+    while (i-- > 0) {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_free_device(&aesd_devices[i]);
     }
+    kfree(aesd_devices);
+    aesd_blob_destroy_caches();
+    unregister_chrdev_region(dev, aesd_nr_devs);
     return result;
 
 }
 
 void aesd_cleanup_module(void)
 {
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
+    unsigned int i;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
-    cdev_del(&aesd_device.cdev);
-
-    /**
-     * TODO: cleanup AESD specific poritions here as necessary
-     */
-    
-
-    // Free the memory allocated for each buffer entry
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circular_buf, index)
-    {
-        if (entry->buffptr) {
-            kfree((void *)entry->buffptr); // Cast to non-const void*
-        }
+    debugfs_remove_recursive(aesd_debugfs_root);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_free_device(&aesd_devices[i]);
     }
-    
+    // Wait for entries still queued by aesd_blob_put
+    rcu_barrier();
+    kfree(aesd_devices);
+    for (i = 0; i <= AESD_BLOB_CLASSES; i++) {
+        printk(KERN_INFO "aesdchar: %s blobs: %lld allocated, %lld freed\n",
+                i < AESD_BLOB_CLASSES ? aesd_blob_cache_name[i] : "kmalloc",
+                (long long)atomic64_read(&aesd_blob_allocs[i]), (long long)atomic64_read(&aesd_blob_frees[i]));
+    }
+    aesd_blob_destroy_caches();
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
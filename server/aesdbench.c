@@ -0,0 +1,332 @@
+/**
+ * @file aesdbench.c
+ * @brief Load generator and latency benchmark for the aesdsocket protocol
+ *
+ * Every request opens a connection, sends one newline terminated packet and
+ * reads the replay until the server closes the connection. Latency is measured
+ * from connect to the first replay byte and to the end of the replay. Results
+ * are printed as one JSON object on stdout.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "string.h"
+#include "sys/socket.h"
+#include "sys/types.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "arpa/inet.h"
+#include "netdb.h"
+#include "errno.h"
+#include "time.h"
+#include "pthread.h"
+
+#define RECV_SIZE (64 * 1024)
+
+struct bench_config_t {
+    const char *host;
+    const char *port;
+    int connections;
+    int requests;
+    size_t packet_size;
+    /* requests per second for each connection, 0 for no pacing */
+    double rate;
+    /* every n-th request is an AESDCHAR_IOCSEEKTO command, 0 for none */
+    int seek_every;
+};
+
+struct worker_t {
+    pthread_t tid;
+    int id;
+    struct bench_config_t *cfg;
+    /* latencies in nanoseconds, one per successful request */
+    unsigned long long *first_byte;
+    unsigned long long *full;
+    int done;
+    int errors;
+    unsigned long long bytes_out;
+    unsigned long long bytes_in;
+};
+
+static struct addrinfo *server_addr;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(unsigned long long t)
+{
+    struct timespec ts;
+
+    ts.tv_sec = t / 1000000000ULL;
+    ts.tv_nsec = t % 1000000000ULL;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
+
+/**
+ * Runs one request.
+ * @return 0 on success, -1 on error
+ */
+static int request(struct worker_t *w, const char *packet, size_t len, char *buf)
+{
+    int sd;
+    int one;
+    ssize_t n;
+    size_t sent;
+    unsigned long long start, first;
+
+    start = now_ns();
+    first = 0;
+    sd = socket(server_addr->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if(sd < 0)
+        return -1;
+    one = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(connect(sd, server_addr->ai_addr, server_addr->ai_addrlen) < 0)
+        goto error;
+    for(sent = 0; sent < len; sent += n)
+    {
+        n = send(sd, packet + sent, len - sent, MSG_NOSIGNAL);
+        if(n < 0)
+            goto error;
+    }
+    w->bytes_out += len;
+    while(1)
+    {
+        n = recv(sd, buf, RECV_SIZE, 0);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            goto error;
+        }
+        if(n == 0)
+            break;
+        if(first == 0)
+            first = now_ns();
+        w->bytes_in += n;
+    }
+    close(sd);
+    if(first == 0)
+        return -1;
+    w->first_byte[w->done] = first - start;
+    w->full[w->done] = now_ns() - start;
+    w->done++;
+    return 0;
+
+error:
+    close(sd);
+    return -1;
+}
+
+static void* worker_entry(void *args)
+{
+    struct worker_t *w = (struct worker_t*)args;
+    struct bench_config_t *cfg = w->cfg;
+    char *packet, *buf;
+    char seek[64];
+    size_t seek_len;
+    unsigned long long next, interval;
+    int i;
+
+    packet = (char*)malloc(cfg->packet_size);
+    buf = (char*)malloc(RECV_SIZE);
+    if(packet == NULL || buf == NULL)
+    {
+        w->errors = cfg->requests;
+        goto out;
+    }
+    memset(packet, 'a' + w->id % 26, cfg->packet_size - 1);
+    packet[cfg->packet_size - 1] = '\n';
+    seek_len = snprintf(seek, sizeof(seek), "AESDCHAR_IOCSEEKTO:0,0\n");
+
+    interval = cfg->rate > 0 ? (unsigned long long)(1000000000.0 / cfg->rate) : 0;
+    next = now_ns();
+    for(i = 0; i < cfg->requests; i++)
+    {
+        if(interval > 0)
+        {
+            sleep_until(next);
+            next += interval;
+        }
+        if(cfg->seek_every > 0 && (i + 1) % cfg->seek_every == 0)
+        {
+            if(request(w, seek, seek_len, buf) < 0)
+                w->errors++;
+        }
+        else if(request(w, packet, cfg->packet_size, buf) < 0)
+        {
+            w->errors++;
+        }
+    }
+
+out:
+    free(packet);
+    free(buf);
+    return 0;
+}
+
+static int compare(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(unsigned long long *v, size_t n, double p)
+{
+    size_t idx;
+
+    if(n == 0)
+        return 0;
+    idx = (size_t)(p * (n - 1) + 0.5);
+    return v[idx] / 1000.0;
+}
+
+static void print_latency(const char *name, unsigned long long *v, size_t n)
+{
+    unsigned long long sum;
+    size_t i;
+
+    qsort(v, n, sizeof(*v), compare);
+    for(sum = 0, i = 0; i < n; i++)
+        sum += v[i];
+    printf("  \"%s\": {\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}",
+            name, n > 0 ? sum / 1000.0 / n : 0,
+            percentile_us(v, n, 0.5), percentile_us(v, n, 0.99), percentile_us(v, n, 0.999),
+            n > 0 ? v[n - 1] / 1000.0 : 0);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-n requests per connection]\n"
+            "       [-s packet size] [-r requests/s per connection] [-k seek every k-th request]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config_t cfg;
+    struct addrinfo hints;
+    struct worker_t *workers;
+    unsigned long long *first_byte, *full;
+    unsigned long long start, elapsed, bytes_in, bytes_out;
+    size_t total;
+    int errors;
+    int i, opt;
+
+    cfg.host = "localhost";
+    cfg.port = "9000";
+    cfg.connections = 1;
+    cfg.requests = 100;
+    cfg.packet_size = 64;
+    cfg.rate = 0;
+    cfg.seek_every = 0;
+
+    while((opt = getopt(argc, argv, "h:p:c:n:s:r:k:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'h':
+                cfg.host = optarg;
+                break;
+            case 'p':
+                cfg.port = optarg;
+                break;
+            case 'c':
+                cfg.connections = atoi(optarg);
+                break;
+            case 'n':
+                cfg.requests = atoi(optarg);
+                break;
+            case 's':
+                cfg.packet_size = strtoul(optarg, 0, 0);
+                break;
+            case 'r':
+                cfg.rate = atof(optarg);
+                break;
+            case 'k':
+                cfg.seek_every = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(cfg.connections <= 0 || cfg.requests <= 0 || cfg.packet_size < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if((errno = getaddrinfo(cfg.host, cfg.port, &hints, &server_addr)) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", cfg.host, gai_strerror(errno));
+        return 1;
+    }
+
+    workers = (struct worker_t*)calloc(cfg.connections, sizeof(struct worker_t));
+    first_byte = (unsigned long long*)calloc((size_t)cfg.connections * cfg.requests, sizeof(unsigned long long));
+    full = (unsigned long long*)calloc((size_t)cfg.connections * cfg.requests, sizeof(unsigned long long));
+    if(workers == NULL || first_byte == NULL || full == NULL)
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    start = now_ns();
+    for(i = 0; i < cfg.connections; i++)
+    {
+        workers[i].id = i;
+        workers[i].cfg = &cfg;
+        workers[i].first_byte = &first_byte[(size_t)i * cfg.requests];
+        workers[i].full = &full[(size_t)i * cfg.requests];
+        if(pthread_create(&workers[i].tid, 0, worker_entry, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    total = 0;
+    errors = 0;
+    bytes_in = 0;
+    bytes_out = 0;
+    for(i = 0; i < cfg.connections; i++)
+    {
+        pthread_join(workers[i].tid, 0);
+        //compact the per worker results to the front
+        memmove(&first_byte[total], workers[i].first_byte, workers[i].done * sizeof(unsigned long long));
+        memmove(&full[total], workers[i].full, workers[i].done * sizeof(unsigned long long));
+        total += workers[i].done;
+        errors += workers[i].errors;
+        bytes_in += workers[i].bytes_in;
+        bytes_out += workers[i].bytes_out;
+    }
+    elapsed = now_ns() - start;
+
+    printf("{\n");
+    printf("  \"host\": \"%s\", \"port\": \"%s\", \"connections\": %d, \"requests_per_connection\": %d,\n",
+            cfg.host, cfg.port, cfg.connections, cfg.requests);
+    printf("  \"packet_size\": %zu, \"rate\": %.1f, \"seek_every\": %d,\n", cfg.packet_size, cfg.rate, cfg.seek_every);
+    printf("  \"completed\": %zu, \"errors\": %d, \"elapsed_s\": %.3f,\n", total, errors, elapsed / 1e9);
+    printf("  \"requests_per_s\": %.1f, \"bytes_out_per_s\": %.1f, \"bytes_in_per_s\": %.1f,\n",
+            total / (elapsed / 1e9), bytes_out / (elapsed / 1e9), bytes_in / (elapsed / 1e9));
+    print_latency("first_byte_latency", first_byte, total);
+    printf(",\n");
+    print_latency("full_replay_latency", full, total);
+    printf("\n}\n");
+
+    freeaddrinfo(server_addr);
+    free(workers);
+    free(first_byte);
+    free(full);
+    return errors > 0 ? 2 : 0;
+}
@@ -0,0 +1,173 @@
+/**
+ * @file aesdimage.c
+ * @brief Saves the commands held by an aesdchar device to a file and restores them
+ *
+ * aesdchar_unload saves every device before the module goes away and
+ * aesdchar_load restores them once the nodes exist again, when AESD_IMAGE_DIR
+ * is set. The file is the image returned by AESDCHAR_IOCSAVE as is, so a
+ * restore is one read of the file and one ioctl.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "string.h"
+#include "fcntl.h"
+#include "errno.h"
+#include "sys/stat.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+/**
+ * Writes size bytes of buf to path, through a temporary file so a crash never leaves half an image.
+ * @return 0 on success, -1 on error
+ */
+static int write_file(const char *path, const char *buf, size_t size)
+{
+    char tmp[4096];
+    ssize_t n;
+    size_t done;
+    int fd, len;
+
+    len = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if(len < 0 || (size_t)len >= sizeof(tmp))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return -1;
+    for(done = 0; done < size; done += n)
+    {
+        n = write(fd, buf + done, size - done);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                n = 0;
+                continue;
+            }
+            goto fail;
+        }
+    }
+    if(fsync(fd) < 0)
+        goto fail;
+    close(fd);
+    return rename(tmp, path);
+
+fail:
+    close(fd);
+    unlink(tmp);
+    return -1;
+}
+
+/**
+ * Saves the contents of device to path.
+ * @return 0 on success, -1 on error
+ */
+static int save(const char *device, const char *path)
+{
+    struct aesd_image image;
+    char *buf;
+    int fd, result;
+
+    fd = open(device, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    // Ask for the size first, retry if a write made the image grow in between
+    memset(&image, 0, sizeof(image));
+    buf = NULL;
+    while((result = ioctl(fd, AESDCHAR_IOCSAVE, &image)) < 0 && errno == ENOSPC)
+    {
+        free(buf);
+        buf = (char*)malloc(image.bytes);
+        if(buf == NULL)
+            break;
+        image.buf = (uintptr_t)buf;
+        image.buf_size = image.bytes;
+    }
+    close(fd);
+    if(result == 0)
+        result = write_file(path, buf, image.bytes);
+    free(buf);
+    return result;
+}
+
+/**
+ * Appends the commands saved in path to device.
+ * @return 0 on success, -1 on error
+ */
+static int restore(const char *device, const char *path)
+{
+    struct aesd_image image;
+    struct stat st;
+    char *buf;
+    ssize_t n;
+    size_t size, done;
+    int fd, result;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    result = -1;
+    buf = NULL;
+    if(fstat(fd, &st) < 0)
+        goto out;
+    size = (size_t)st.st_size;
+    if((buf = (char*)malloc(size)) == NULL)
+        goto out;
+    for(done = 0; done < size; done += n)
+    {
+        n = read(fd, buf + done, size - done);
+        if(n < 0 && errno == EINTR)
+            n = 0;
+        else if(n <= 0)
+            goto out;
+    }
+    close(fd);
+
+    fd = open(device, O_WRONLY);
+    if(fd < 0)
+        goto out;
+    memset(&image, 0, sizeof(image));
+    image.buf = (uintptr_t)buf;
+    image.buf_size = size;
+    result = ioctl(fd, AESDCHAR_IOCRESTORE, &image);
+
+out:
+    if(fd >= 0)
+        close(fd);
+    free(buf);
+    return result;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s save|restore device file\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int result;
+
+    if(argc != 4)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if(strcmp(argv[1], "save") == 0)
+        result = save(argv[2], argv[3]);
+    else if(strcmp(argv[1], "restore") == 0)
+        result = restore(argv[2], argv[3]);
+    else
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if(result < 0)
+    {
+        fprintf(stderr, "%s %s %s: %s\n", argv[1], argv[2], argv[3], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,190 @@
+/**
+ * @file aesdlog.c
+ * @brief Asynchronous, rate limited logging for aesdsocket
+ *
+ * The ring is a bounded multi-producer queue: producers claim a slot by
+ * advancing head with a compare and swap and publish it through the slot's
+ * sequence number, the single drain thread consumes in order. A full ring
+ * drops the message rather than waiting. An idle drain thread sleeps on a
+ * condition variable, producers only take its mutex to wake it.
+ */
+
+#include "stdio.h"
+#include "stdarg.h"
+#include "string.h"
+#include "time.h"
+#include "pthread.h"
+#include "aesdlog.h"
+
+struct log_slot_t {
+    unsigned long seq;
+    int level;
+    char msg[AESD_LOG_MSG_SIZE];
+};
+
+static struct log_slot_t ring[AESD_LOG_RING_SIZE];
+static unsigned long head;
+static unsigned long tail;
+static int log_level = LOG_DEBUG;
+static unsigned int log_rate;
+static volatile int running;
+static pthread_t drain_tid;
+static pthread_mutex_t idle_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+/* set while the drain thread waits for idle_cond */
+static int idle;
+/* rate limiting window, in seconds since the epoch */
+static time_t window;
+static unsigned int window_count;
+static unsigned long dropped;
+static unsigned long suppressed;
+
+static int drain(void)
+{
+    struct log_slot_t *slot;
+    int n;
+
+    n = 0;
+    while(1)
+    {
+        slot = &ring[tail & (AESD_LOG_RING_SIZE - 1)];
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1)
+            break;
+        syslog(slot->level, "%s", slot->msg);
+        __atomic_store_n(&slot->seq, tail + AESD_LOG_RING_SIZE, __ATOMIC_RELEASE);
+        tail++;
+        n++;
+    }
+    return n;
+}
+
+static int pending(void)
+{
+    return __atomic_load_n(&ring[tail & (AESD_LOG_RING_SIZE - 1)].seq, __ATOMIC_ACQUIRE) == tail + 1;
+}
+
+static void* drain_entry(void *args)
+{
+    while(running)
+    {
+        if(drain() > 0)
+            continue;
+        pthread_mutex_lock(&idle_mtx);
+        __atomic_store_n(&idle, 1, __ATOMIC_RELAXED);
+        //pairs with the fence in aesd_log: either the producer sees idle or this sees its message
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while(running && !pending())
+            pthread_cond_wait(&idle_cond, &idle_mtx);
+        __atomic_store_n(&idle, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&idle_mtx);
+    }
+    drain();
+    return 0;
+}
+
+/**
+ * @return 0 if the message is over the per-second budget
+ */
+static int rate_allows(int level)
+{
+    time_t now;
+    time_t current;
+
+    if(log_rate == 0 || level <= LOG_WARNING)
+        return 1;
+    now = time(0);
+    current = __atomic_load_n(&window, __ATOMIC_RELAXED);
+    if(now != current && __atomic_compare_exchange_n(&window, &current, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        __atomic_store_n(&window_count, 0, __ATOMIC_RELAXED);
+    if(__atomic_add_fetch(&window_count, 1, __ATOMIC_RELAXED) > log_rate)
+    {
+        __atomic_add_fetch(&suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+void aesd_log(int level, const char *fmt, ...)
+{
+    va_list ap;
+    struct log_slot_t *slot;
+    unsigned long pos;
+    long diff;
+
+    if(level > log_level || !rate_allows(level))
+        return;
+    va_start(ap, fmt);
+    if(!running)
+    {
+        vsyslog(level, fmt, ap);
+        va_end(ap);
+        return;
+    }
+    pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    while(1)
+    {
+        slot = &ring[pos & (AESD_LOG_RING_SIZE - 1)];
+        diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0)
+        {
+            if(__atomic_compare_exchange_n(&head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(diff < 0)
+        {
+            //ring is full, never block the caller
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            va_end(ap);
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+    vsnprintf(slot->msg, AESD_LOG_MSG_SIZE, fmt, ap);
+    va_end(ap);
+    slot->level = level;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&idle, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&idle_mtx);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_mtx);
+    }
+}
+
+int aesd_log_start(int level, unsigned int rate)
+{
+    unsigned long i;
+
+    for(i = 0; i < AESD_LOG_RING_SIZE; i++)
+        ring[i].seq = i;
+    head = 0;
+    tail = 0;
+    log_level = level;
+    log_rate = rate;
+    running = 1;
+    if(pthread_create(&drain_tid, 0, drain_entry, 0) != 0)
+    {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void aesd_log_stop(void)
+{
+    if(!running)
+        return;
+    pthread_mutex_lock(&idle_mtx);
+    running = 0;
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_mtx);
+    pthread_join(drain_tid, 0);
+    //messages published while the drain thread was finishing
+    drain();
+    if(dropped > 0 || suppressed > 0)
+        syslog(LOG_WARNING, "%lu log messages dropped, %lu rate limited", dropped, suppressed);
+}
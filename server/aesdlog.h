@@ -0,0 +1,64 @@
+/*
+ * aesdlog.h
+ *
+ *  @brief Asynchronous, rate limited logging for aesdsocket
+ *
+ *  Messages are formatted by the caller into a lock-free ring buffer and
+ *  handed to syslog by a background thread, so connection threads never
+ *  block on the syslog socket.
+ */
+
+#ifndef AESDLOG_H
+#define AESDLOG_H
+
+#include "syslog.h"
+
+//#define AESDSOCKET_DEBUG 1  //Remove comment on this line to enable hot path debug logging
+
+#undef PDEBUG
+#ifdef AESDSOCKET_DEBUG
+#  define PDEBUG(fmt, args...) aesd_log(LOG_DEBUG, fmt, ## args)
+#else
+#  define PDEBUG(fmt, args...) /* not debugging: nothing */
+#endif
+
+/**
+ * Number of messages the ring can hold before new ones are dropped, must be a
+ * power of two
+ */
+#define AESD_LOG_RING_SIZE 1024
+/**
+ * Maximum length of one formatted message, longer ones are truncated
+ */
+#define AESD_LOG_MSG_SIZE 256
+
+/**
+ * Logs only every n-th call from this call site, for messages that can come
+ * in storms.
+ */
+#define aesd_log_every(n, level, fmt, args...) \
+    do { \
+        static unsigned long _aesd_log_calls; \
+        if(__atomic_fetch_add(&_aesd_log_calls, 1, __ATOMIC_RELAXED) % (n) == 0) \
+            aesd_log(level, fmt, ## args); \
+    } while(0)
+
+/**
+ * Starts the drain thread.
+ * @param level messages less severe than this syslog priority are discarded
+ * @param rate maximum number of messages per second below LOG_WARNING, 0 for
+ * no limit. Warnings and errors are never rate limited.
+ * @return 0 on success, -1 on error. Until started, messages go to syslog
+ * directly.
+ */
+extern int aesd_log_start(int level, unsigned int rate);
+
+/**
+ * Flushes all queued messages, reports how many were dropped and stops the
+ * drain thread.
+ */
+extern void aesd_log_stop(void);
+
+extern void aesd_log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* AESDLOG_H */
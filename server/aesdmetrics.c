@@ -0,0 +1,217 @@
+/**
+ * @file aesdmetrics.c
+ * @brief Runtime counters and histograms for aesdsocket
+ *
+ * Each thread picks a shard on its first update and only ever adds to that
+ * shard. Shards are cache line aligned so threads do not share lines. A scrape
+ * sums all shards without stopping the writers, so a scrape may be a few
+ * updates behind, which is fine for monitoring.
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "string.h"
+#include "sys/socket.h"
+#include "netinet/in.h"
+#include "errno.h"
+#include "sys/time.h"
+#include "pthread.h"
+#include "aesdmetrics.h"
+#include "aesdlog.h"
+
+#define METRICS_SHARDS 64
+/* seconds a scraper gets to send its request and take the answer */
+#define METRICS_TIMEOUT 2
+
+struct histogram_t {
+    unsigned long long buckets[AESD_METRICS_BUCKETS];
+    unsigned long long sum;
+    unsigned long long count;
+};
+
+struct metrics_shard_t {
+    unsigned long long counters[AESD_COUNTERS];
+    struct histogram_t histograms[AESD_HISTOGRAMS];
+} __attribute__((aligned(64)));
+
+static struct metrics_shard_t shards[METRICS_SHARDS];
+static unsigned int next_shard;
+static __thread struct metrics_shard_t *own_shard;
+
+static int metrics_sd = -1;
+static pthread_t metrics_tid;
+
+static const char *counter_names[AESD_COUNTERS] = {
+    "aesdsocket_connections_accepted_total",
+    "aesdsocket_connections_closed_total",
+    "aesdsocket_connections_rejected_total",
+    "aesdsocket_bytes_in_total",
+    "aesdsocket_bytes_out_total",
+    "aesdsocket_packets_committed_total",
+};
+
+static const char *histogram_names[AESD_HISTOGRAMS] = {
+    "aesdsocket_replay_bytes",
+    "aesdsocket_write_lock_wait_ns",
+    "aesdsocket_request_ns",
+};
+
+static struct metrics_shard_t* shard(void)
+{
+    if(own_shard == NULL)
+        own_shard = &shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS];
+    return own_shard;
+}
+
+void aesd_metrics_add(enum aesd_counter counter, unsigned long value)
+{
+    __atomic_add_fetch(&shard()->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void aesd_metrics_observe(enum aesd_histogram histogram, unsigned long long value)
+{
+    struct histogram_t *h;
+    int bucket;
+
+    h = &shard()->histograms[histogram];
+    bucket = value > 0 ? 64 - __builtin_clzll(value) : 0;
+    if(bucket >= AESD_METRICS_BUCKETS)
+        bucket = AESD_METRICS_BUCKETS - 1;
+    __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+static unsigned long long sum_counter(int counter)
+{
+    unsigned long long v;
+    int i;
+
+    for(v = 0, i = 0; i < METRICS_SHARDS; i++)
+        v += __atomic_load_n(&shards[i].counters[counter], __ATOMIC_RELAXED);
+    return v;
+}
+
+static void write_metrics(FILE *out)
+{
+    struct histogram_t h;
+    unsigned long long cumulative;
+    int c, i, b;
+
+    for(c = 0; c < AESD_COUNTERS; c++)
+    {
+        fprintf(out, "# TYPE %s counter\n%s %llu\n", counter_names[c], counter_names[c], sum_counter(c));
+    }
+    fprintf(out, "# TYPE aesdsocket_connections_active gauge\naesdsocket_connections_active %lld\n",
+            (long long)(sum_counter(AESD_ACCEPTED) - sum_counter(AESD_CLOSED)));
+
+    for(c = 0; c < AESD_HISTOGRAMS; c++)
+    {
+        memset(&h, 0, sizeof(h));
+        for(i = 0; i < METRICS_SHARDS; i++)
+        {
+            for(b = 0; b < AESD_METRICS_BUCKETS; b++)
+                h.buckets[b] += __atomic_load_n(&shards[i].histograms[c].buckets[b], __ATOMIC_RELAXED);
+            h.sum += __atomic_load_n(&shards[i].histograms[c].sum, __ATOMIC_RELAXED);
+            h.count += __atomic_load_n(&shards[i].histograms[c].count, __ATOMIC_RELAXED);
+        }
+        fprintf(out, "# TYPE %s histogram\n", histogram_names[c]);
+        cumulative = 0;
+        for(b = 0; b < AESD_METRICS_BUCKETS - 1; b++)
+        {
+            cumulative += h.buckets[b];
+            //bucket b holds values below 2^b, i.e. at most 2^b - 1
+            fprintf(out, "%s_bucket{le=\"%llu\"} %llu\n", histogram_names[c], (1ULL << b) - 1, cumulative);
+        }
+        cumulative += h.buckets[AESD_METRICS_BUCKETS - 1];
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", histogram_names[c], cumulative);
+        fprintf(out, "%s_sum %llu\n%s_count %llu\n", histogram_names[c], h.sum, histogram_names[c], h.count);
+    }
+}
+
+static void* metrics_entry(void *args)
+{
+    char request[1024];
+    char header[128];
+    char *body;
+    size_t body_len;
+    FILE *out;
+    struct timeval tv;
+    int sd;
+
+    while(1)
+    {
+        sd = accept(metrics_sd, 0, 0);
+        if(sd < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            //listener shut down
+            break;
+        }
+        //scrapers are served one at a time, an idle one must not stall the others
+        memset(&tv, 0, sizeof(tv));
+        tv.tv_sec = METRICS_TIMEOUT;
+        if(setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+           setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+        {
+            close(sd);
+            continue;
+        }
+        //any request gets the metrics, the request itself is not parsed
+        if(recv(sd, request, sizeof(request), 0) >= 0)
+        {
+            body = NULL;
+            out = open_memstream(&body, &body_len);
+            if(out != NULL)
+            {
+                write_metrics(out);
+                fclose(out);
+                snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\n\r\n", body_len);
+                if(send(sd, header, strlen(header), MSG_NOSIGNAL | MSG_MORE) < 0 ||
+                   send(sd, body, body_len, MSG_NOSIGNAL) < 0)
+                    aesd_log(LOG_ERR, "%s (CODE %d)", strerror(errno), errno);
+            }
+            free(body);
+        }
+        close(sd);
+    }
+    return 0;
+}
+
+int aesd_metrics_start(unsigned short port)
+{
+    struct sockaddr_in sa;
+    int one;
+
+    metrics_sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(metrics_sd < 0)
+        return -1;
+    one = 1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_addr.s_addr = INADDR_ANY;
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if(setsockopt(metrics_sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+       bind(metrics_sd, (struct sockaddr*)&sa, sizeof(sa)) < 0 ||
+       listen(metrics_sd, 5) < 0 ||
+       pthread_create(&metrics_tid, 0, metrics_entry, 0) != 0)
+    {
+        close(metrics_sd);
+        metrics_sd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void aesd_metrics_stop(void)
+{
+    if(metrics_sd < 0)
+        return;
+    shutdown(metrics_sd, SHUT_RDWR);
+    pthread_join(metrics_tid, 0);
+    close(metrics_sd);
+    metrics_sd = -1;
+}
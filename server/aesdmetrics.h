@@ -0,0 +1,61 @@
+/*
+ * aesdmetrics.h
+ *
+ *  @brief Runtime counters and histograms for aesdsocket
+ *
+ *  Updates go to a per-thread shard with relaxed atomics, so they never take
+ *  a lock. A metrics listener sums the shards on each scrape and answers in
+ *  the Prometheus text exposition format.
+ */
+
+#ifndef AESDMETRICS_H
+#define AESDMETRICS_H
+
+#include "time.h"
+
+enum aesd_counter {
+    AESD_ACCEPTED,
+    AESD_CLOSED,
+    AESD_REJECTED,
+    AESD_BYTES_IN,
+    AESD_BYTES_OUT,
+    AESD_PACKETS,
+    AESD_COUNTERS
+};
+
+enum aesd_histogram {
+    /* bytes sent per replay */
+    AESD_REPLAY_BYTES,
+    /* nanoseconds spent waiting for the write lock */
+    AESD_LOCK_WAIT_NS,
+    /* nanoseconds from accept to the end of the replay */
+    AESD_REQUEST_NS,
+    AESD_HISTOGRAMS
+};
+
+/**
+ * Histogram buckets are powers of two, bucket i counts values below 2^i
+ */
+#define AESD_METRICS_BUCKETS 48
+
+extern void aesd_metrics_add(enum aesd_counter counter, unsigned long value);
+
+extern void aesd_metrics_observe(enum aesd_histogram histogram, unsigned long long value);
+
+/**
+ * Starts serving the metrics over HTTP on port.
+ * @return 0 on success, -1 on error
+ */
+extern int aesd_metrics_start(unsigned short port);
+
+extern void aesd_metrics_stop(void);
+
+static inline unsigned long long aesd_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* AESDMETRICS_H */
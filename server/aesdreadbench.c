@@ -0,0 +1,202 @@
+/**
+ * @file aesdreadbench.c
+ * @brief Compares read() and splice() throughput when draining /dev/aesdchar
+ *
+ * Each iteration opens the device, moves its whole contents and closes it
+ * again, the way aesdsocket replays it to a client. read() copies into a user
+ * buffer, splice() moves the data through a pipe into /dev/null without it
+ * ever reaching user space. Results are printed as one JSON object on stdout.
+ */
+
+#define _GNU_SOURCE
+#include "stdio.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "string.h"
+#include "fcntl.h"
+#include "errno.h"
+#include "time.h"
+
+#define PIPE_SIZE (1024 * 1024)
+
+struct result_t {
+    unsigned long long bytes;
+    unsigned long long ns;
+};
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Drains path once with read().
+ * @return bytes read or -1 on error
+ */
+static long long drain_read(const char *path, char *buf, size_t size)
+{
+    long long total;
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    total = 0;
+    while((n = read(fd, buf, size)) != 0)
+    {
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            total = -1;
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+    return total;
+}
+
+/**
+ * Drains path once with splice() through pipe_fd into null_fd.
+ * @return bytes moved or -1 on error
+ */
+static long long drain_splice(const char *path, int pipe_fd[2], int null_fd)
+{
+    long long total;
+    ssize_t n, out;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    total = 0;
+    while((n = splice(fd, NULL, pipe_fd[1], NULL, PIPE_SIZE, SPLICE_F_MOVE)) != 0)
+    {
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            total = -1;
+            break;
+        }
+        while(n > 0)
+        {
+            out = splice(pipe_fd[0], NULL, null_fd, NULL, n, SPLICE_F_MOVE);
+            if(out < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                close(fd);
+                return -1;
+            }
+            n -= out;
+            total += out;
+        }
+    }
+    close(fd);
+    return total;
+}
+
+static void print_result(const char *name, struct result_t *r, int iterations)
+{
+    printf("  \"%s\": {\"bytes_per_iteration\": %llu, \"us_per_iteration\": %.1f, \"mb_per_s\": %.1f}",
+            name, r->bytes / iterations, r->ns / 1000.0 / iterations,
+            r->ns > 0 ? r->bytes / (r->ns / 1e9) / 1e6 : 0);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-f path] [-n iterations] [-b read buffer size]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/dev/aesdchar";
+    int iterations = 100;
+    size_t buf_size = 64 * 1024;
+    struct result_t rd, sp;
+    long long n;
+    char *buf;
+    int pipe_fd[2];
+    int null_fd;
+    int i, opt;
+    unsigned long long start;
+
+    while((opt = getopt(argc, argv, "f:n:b:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'f':
+                path = optarg;
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'b':
+                buf_size = strtoul(optarg, 0, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(iterations <= 0 || buf_size == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    buf = (char*)malloc(buf_size);
+    null_fd = open("/dev/null", O_WRONLY);
+    if(buf == NULL || null_fd < 0 || pipe(pipe_fd) < 0)
+    {
+        perror("setup");
+        return 1;
+    }
+    //best effort, the default pipe size just means more round trips
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, PIPE_SIZE);
+
+    memset(&rd, 0, sizeof(rd));
+    start = now_ns();
+    for(i = 0; i < iterations; i++)
+    {
+        if((n = drain_read(path, buf, buf_size)) < 0)
+        {
+            perror("read");
+            return 1;
+        }
+        rd.bytes += n;
+    }
+    rd.ns = now_ns() - start;
+
+    memset(&sp, 0, sizeof(sp));
+    start = now_ns();
+    for(i = 0; i < iterations; i++)
+    {
+        if((n = drain_splice(path, pipe_fd, null_fd)) < 0)
+        {
+            perror("splice");
+            return 1;
+        }
+        sp.bytes += n;
+    }
+    sp.ns = now_ns() - start;
+
+    printf("{\n");
+    printf("  \"path\": \"%s\", \"iterations\": %d, \"read_buffer_size\": %zu,\n", path, iterations, buf_size);
+    print_result("read", &rd, iterations);
+    printf(",\n");
+    print_result("splice", &sp, iterations);
+    printf("\n}\n");
+
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    close(null_fd);
+    free(buf);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "stdio.h"
 #include "stdlib.h"
 #include "unistd.h"
@@ -13,11 +14,24 @@
 #include "time.h"
 #include "sys/queue.h"
 #include "pthread.h"
+#include "fcntl.h"
+#include "sys/epoll.h"
+#include "sys/eventfd.h"
+#include "sys/stat.h"
+#include "sys/sendfile.h"
+#include "sched.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdlog.h"
+#include "aesdmetrics.h"
 
 
 
 #define BUFFER_SIZE 1024
+#define EVENT_MAX 64
+#define REPLAY_PIPE_SIZE (1024 * 1024)
+#ifndef PORT
+#define PORT 9000
+#endif
 
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
@@ -32,107 +46,662 @@
 
 
 
+#ifndef OFN
 #ifdef ASSIGNMENT_8
 #define OFN "/dev/aesdchar"
 #else
 #define OFN "/var/tmp/aesdsocketdata"
 #endif /* ASSIGNMENT_8 */
+#endif /* OFN */
 
 struct client_t {
     struct sockaddr_in addr;
-    int addr_len;
+    socklen_t addr_len;
     int sd;
     pthread_t tid;
+    /* pending input and pending replay */
+    char *rx;
+    size_t rx_len;
+    size_t rx_size;
+    char *tx;
+    size_t tx_len;
+    size_t tx_off;
+    /* zero copy replay straight from the backing store */
+    int replay_fd;
+    off_t replay_off;
+    off_t replay_len;
+    int pipe_fd[2];
+    size_t piped;
+    int replay_eof;
+    /* replay served from the in-process cache */
+    struct replay_cache_t *snap;
+    size_t snap_off;
+    /* backing store this client writes to and replays from */
+    struct store_t *store;
+    /* bytes of the current replay sent so far, for the metrics */
+    size_t replay_sent;
+    int replaying;
+    unsigned long long start_ns;
+    int done;
     LIST_ENTRY(client_t) entries;
 };
 
+LIST_HEAD(client_list, client_t);
+
+struct event_loop_t {
+    int epfd;
+    int wake_fd;
+    pthread_t tid;
+    pthread_mutex_t mtx;
+    struct client_list clients;
+};
+
+/**
+ * Immutable (once shared) copy of the replay contents. Clients keep a
+ * reference while sending, writers replace the current copy instead of
+ * modifying one that is still referenced.
+ */
+struct replay_cache_t {
+    char *data;
+    size_t len;
+    size_t size;
+    /* store generation the copy reflects */
+    unsigned long generation;
+    int refs;
+};
+
+/**
+ * One backing store (device minor or file) with its own write lock and replay
+ * cache, so clients hashed to different stores never contend.
+ */
+struct store_t {
+    char path[64];
+    pthread_mutex_t wr_mtx;
+    /* current replay cache, guarded by wr_mtx */
+    struct replay_cache_t *cache;
+    /* packets committed so far, guarded by wr_mtx. The cache is current while its generation matches. */
+    unsigned long generation;
+};
+
+struct worker_pool_t {
+    pthread_t *tids;
+    int nworkers;
+    /* bounded queue of accepted connections waiting for a worker */
+    struct client_t **queue;
+    int head;
+    int count;
+    int max_inflight;
+    /* queued plus currently served connections */
+    int inflight;
+    int reject;
+    pthread_mutex_t mtx;
+    pthread_cond_t has_work;
+    pthread_cond_t has_room;
+};
+
+struct listener_t {
+    int sd;
+    /* CPU the accept loop is pinned to, -1 for none */
+    int cpu;
+    pthread_t tid;
+    int tid_valid;
+};
 
-int server;
+struct listener_t *listeners;
+int nlisteners;
 volatile int run;
-LIST_HEAD(client_list, client_t) cl_head;
-pthread_mutex_t wr_mtx;
+struct client_list cl_head;
+pthread_mutex_t cl_mtx;
+struct store_t *stores;
+int nstores;
+struct event_loop_t *loops;
+int nloops;
+struct worker_pool_t pool;
+int use_cache;
+int event_mode;
+unsigned int next_loop;
+int pool_workers;
+/* with -a, the CPU mask the process started with, for threads serving clients so they are not pinned along with their creator */
+pthread_attr_t client_attr;
+pthread_attr_t *client_attrp;
 
 void sd_handler(int sig)
 {
+    int i;
+
+    //only async-signal-safe calls here, main logs the shutdown once accept_loop returns
     if(sig == SIGINT || sig == SIGTERM)
     {
-        syslog(LOG_INFO, "Caught signal, exiting");
         run = 0;
-        shutdown(server, SHUT_RDWR);
+        for(i = 0; i < nlisteners; i++)
+            shutdown(listeners[i].sd, SHUT_RDWR);
     }
 }
 
-void* thread_entry(void *args)
+int read_contents(int fd, char **buf, size_t *len, size_t *size)
 {
-    int recv_len;
-    char buffer[BUFFER_SIZE];
-    FILE *file;
-#ifdef ASSIGNMENT_9
-    struct aesd_seekto seekto;
-#endif
-    struct client_t *c = (struct client_t*)args;
-    pthread_mutex_lock(&wr_mtx);
-    file = fopen(OFN, "a");
+    ssize_t n;
+    char *tmp;
+
     while(1)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        recv_len = recv(c->sd, buffer, BUFFER_SIZE-1, 0);
-        if(recv_len < 0)
+        //grow geometrically, so reading a long history copies each byte a constant number of times
+        if(*size - *len < BUFFER_SIZE)
         {
-            goto t_exit_with_error;
+            tmp = realloc(*buf, *size > 0 ? *size * 2 : BUFFER_SIZE * 4);
+            if(tmp == NULL)
+                return -1;
+            *buf = tmp;
+            *size = *size > 0 ? *size * 2 : BUFFER_SIZE * 4;
         }
-        else if(recv_len == 0)
+        n = read(fd, *buf + *len, *size - *len);
+        if(n < 0)
         {
-            //client terminated connection
-            break;
+            if(errno == EINTR)
+                continue;
+            return -1;
         }
-#ifdef ASSIGNMENT_9
-        if(sscanf(buffer, "AESDCHAR_IOCSEEKTO:%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset) == 2)
+        if(n == 0)
+            return 0;
+        *len += n;
+    }
+}
+
+void client_replay_close(struct client_t *c);
+
+struct replay_cache_t* cache_new(size_t size)
+{
+    struct replay_cache_t *rc;
+
+    rc = (struct replay_cache_t*)calloc(1, sizeof(struct replay_cache_t));
+    if(rc == NULL)
+        return NULL;
+    rc->data = (char*)malloc(size);
+    if(rc->data == NULL)
+    {
+        free(rc);
+        return NULL;
+    }
+    rc->size = size;
+    rc->refs = 1;
+    return rc;
+}
+
+void cache_put(struct replay_cache_t *rc)
+{
+    if(rc != NULL && __atomic_sub_fetch(&rc->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(rc->data);
+        free(rc);
+    }
+}
+
+/**
+ * Replaces the cache with the contents of fd (read from its current
+ * position). wr_mtx must be held.
+ */
+int cache_reload(struct store_t *s, int fd)
+{
+    struct replay_cache_t *rc;
+
+    rc = cache_new(BUFFER_SIZE * 4);
+    if(rc == NULL)
+        return -1;
+    if(read_contents(fd, &rc->data, &rc->len, &rc->size) < 0)
+    {
+        cache_put(rc);
+        return -1;
+    }
+    rc->generation = s->generation;
+    cache_put(s->cache);
+    s->cache = rc;
+    return 0;
+}
+
+/**
+ * Appends to the cache in place if no client is sending from it, otherwise
+ * into a new, larger copy. wr_mtx must be held.
+ */
+int cache_append(struct store_t *s, const char *buf, size_t len)
+{
+    struct replay_cache_t *rc;
+
+    if(__atomic_load_n(&s->cache->refs, __ATOMIC_ACQUIRE) > 1 || s->cache->size - s->cache->len < len)
+    {
+        rc = cache_new((s->cache->len + len) * 2);
+        if(rc == NULL)
+            return -1;
+        memcpy(rc->data, s->cache->data, s->cache->len);
+        rc->len = s->cache->len;
+        cache_put(s->cache);
+        s->cache = rc;
+    }
+    memcpy(s->cache->data + s->cache->len, buf, len);
+    s->cache->len += len;
+    s->cache->generation = s->generation;
+    return 0;
+}
+
+/**
+ * Points the client's replay at the cache, refreshing it first if packets were
+ * committed since it was taken. This replaces reading the backing store for
+ * every replay. wr_mtx must be held.
+ */
+int cache_attach(struct client_t *c, size_t committed)
+{
+    struct store_t *s = c->store;
+    off_t start;
+
+    start = 0;
+#ifdef ASSIGNMENT_8
+    //the device is reread instead, the committed packets are only appended in the file build
+    (void)committed;
+    //the device drops old entries, so reread it after a write. A seek only moves the start.
+    start = lseek(c->replay_fd, 0, SEEK_CUR);
+    if(start < 0)
+        return -1;
+    if(s->cache == NULL || s->cache->generation != s->generation)
+    {
+        if(lseek(c->replay_fd, 0, SEEK_SET) < 0 || cache_reload(s, c->replay_fd) < 0)
+            return -1;
+    }
+#else
+    if(s->cache == NULL)
+    {
+        //first use, the file already holds the new packet
+        if(cache_reload(s, c->replay_fd) < 0)
+            return -1;
+    }
+    else if(s->cache->generation != s->generation && cache_append(s, c->rx, committed) < 0)
+    {
+        return -1;
+    }
+#endif /* ASSIGNMENT_8 */
+    client_replay_close(c);
+    __atomic_add_fetch(&s->cache->refs, 1, __ATOMIC_ACQ_REL);
+    c->snap = s->cache;
+    c->snap_off = start;
+    return 0;
+}
+
+void client_replay_close(struct client_t *c)
+{
+    cache_put(c->snap);
+    c->snap = NULL;
+    if(c->replay_fd >= 0)
+        close(c->replay_fd);
+    if(c->pipe_fd[0] >= 0)
+        close(c->pipe_fd[0]);
+    if(c->pipe_fd[1] >= 0)
+        close(c->pipe_fd[1]);
+    c->replay_fd = -1;
+    c->pipe_fd[0] = -1;
+    c->pipe_fd[1] = -1;
+    c->piped = 0;
+}
+
+#ifdef ASSIGNMENT_8
+/**
+ * Moves device contents into the replay pipe until the pipe is full or the
+ * device is drained. Drivers without splice support fall back to copying the
+ * contents into c->tx.
+ */
+int replay_fill(struct client_t *c)
+{
+    ssize_t len;
+    size_t tx_size;
+
+    while(!c->replay_eof)
+    {
+        len = splice(c->replay_fd, NULL, c->pipe_fd[1], NULL, REPLAY_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(len < 0)
         {
-            file = freopen(OFN, "r", file);
-            syslog(LOG_INFO, "Setting the file to position %u, %u", seekto.write_cmd, seekto.write_cmd_offset);
-            if(ioctl(fileno(file), AESDCHAR_IOCSEEKTO, &seekto) != 0)
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                return 0;
+            if(errno == EINVAL && c->piped == 0)
             {
-                goto t_exit_with_error;
+                tx_size = c->tx_len;
+                if(read_contents(c->replay_fd, &c->tx, &c->tx_len, &tx_size) < 0)
+                    return -1;
+                client_replay_close(c);
+                c->replay_eof = 1;
+                return 0;
             }
-            syslog(LOG_INFO, "IOCTL - OK");
-            goto return_contents;
+            return -1;
         }
-        else
+        if(len == 0)
+            c->replay_eof = 1;
+        c->piped += len;
+    }
+    return 0;
+}
+
+/**
+ * The char device has no stable length, so it is replayed through a pipe with
+ * splice(). The pipe is filled while wr_mtx is held, which snapshots all but
+ * very long histories.
+ */
+int replay_prepare(struct client_t *c)
+{
+    if(pipe2(c->pipe_fd, O_NONBLOCK) < 0)
+        return -1;
+    //best effort, the default pipe size just means more round trips
+    fcntl(c->pipe_fd[1], F_SETPIPE_SZ, REPLAY_PIPE_SIZE);
+    return replay_fill(c);
+}
+#else
+/**
+ * The file is only ever appended to under wr_mtx, so its current size marks
+ * the replay and the data can be sent later with sendfile().
+ */
+int replay_prepare(struct client_t *c)
+{
+    struct stat st;
+
+    if(fstat(c->replay_fd, &st) < 0)
+        return -1;
+    c->replay_off = 0;
+    c->replay_len = st.st_size;
+    return 0;
+}
+#endif /* ASSIGNMENT_8 */
+
+void replay_done(struct client_t *c)
+{
+    client_replay_close(c);
+    if(c->replaying)
+    {
+        aesd_metrics_add(AESD_BYTES_OUT, c->replay_sent);
+        aesd_metrics_observe(AESD_REPLAY_BYTES, c->replay_sent);
+        aesd_metrics_observe(AESD_REQUEST_NS, aesd_now_ns() - c->start_ns);
+        c->replaying = 0;
+    }
+}
+
+/**
+ * Sends the pending replay, from c->tx when it had to be copied and straight
+ * from the backing store otherwise.
+ * @return 1 when everything was sent, 0 if the socket would block, -1 on error
+ */
+int client_replay(struct client_t *c)
+{
+    ssize_t len;
+
+    while(c->tx_off < c->tx_len)
+    {
+        len = send(c->sd, c->tx + c->tx_off, c->tx_len - c->tx_off, MSG_NOSIGNAL);
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->tx_off += len;
+        c->replay_sent += len;
+    }
+    if(c->snap != NULL)
+    {
+        while(c->snap_off < c->snap->len)
+        {
+            len = send(c->sd, c->snap->data + c->snap_off, c->snap->len - c->snap_off, MSG_NOSIGNAL);
+            if(len < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                return -1;
+            }
+            c->snap_off += len;
+            c->replay_sent += len;
+        }
+        replay_done(c);
+        return 1;
+    }
+    if(c->replay_fd < 0)
+    {
+        replay_done(c);
+        return 1;
+    }
+#ifdef ASSIGNMENT_8
+    while(c->piped > 0 || !c->replay_eof)
+    {
+        if(c->piped == 0)
         {
-            fputs(buffer, file);
+            if(replay_fill(c) < 0)
+                return -1;
+            if(c->replay_fd < 0)
+                return client_replay(c);
+            continue;
         }
+        len = splice(c->pipe_fd[0], NULL, c->sd, NULL, c->piped, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                return 0;
+            return -1;
+        }
+        c->piped -= len;
+        c->replay_sent += len;
+    }
 #else
-        fputs(buffer, file);
-#endif /* ASSIGNMENT_9 */
-        if(recv_len < BUFFER_SIZE && buffer[recv_len-1] == '\n')
+    while(c->replay_off < c->replay_len)
+    {
+        len = sendfile(c->sd, c->replay_fd, &c->replay_off, c->replay_len - c->replay_off);
+        if(len < 0)
         {
-            file = freopen(OFN, "r", file);
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                return 0;
+            return -1;
+        }
+        if(len == 0)
+            break;
+        c->replay_sent += len;
+    }
+#endif /* ASSIGNMENT_8 */
+    replay_done(c);
+    return 1;
+}
+
+/**
+ * Makes room for at least BUFFER_SIZE more bytes (plus a terminator) in c->rx.
+ * The buffer doubles, so packets of many megabytes take few copies.
+ */
+int client_rx_reserve(struct client_t *c)
+{
+    char *tmp;
+    size_t size;
+
+    if(c->rx_size - c->rx_len > BUFFER_SIZE)
+        return 0;
+    size = c->rx_size > 0 ? c->rx_size * 2 : BUFFER_SIZE * 4;
+    tmp = realloc(c->rx, size);
+    if(tmp == NULL)
+        return -1;
+    c->rx = tmp;
+    c->rx_size = size;
+    return 0;
+}
+
+int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while(len > 0)
+    {
+        n = write(fd, buf, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Commits every newline terminated packet collected in c->rx, each with a
+ * single write(), and prepares the replay. Callers wait for the input to end
+ * with a newline, so an unterminated tail is only left when the peer closed
+ * the connection in the middle of a packet, and is then dropped.
+ * wr_mtx is only held for the append and the snapshot of the replay, not while
+ * receiving or sending, so a slow client does not hold up the others.
+ */
+int client_packet(struct client_t *c)
+{
+    int fd;
+    int result;
+    size_t pos;
+    size_t len;
+    char *nl;
+    unsigned long long wait_start;
 #ifdef ASSIGNMENT_9
-return_contents:
+    struct aesd_seekto seekto;
+    int seek;
 #endif
-            while(fgets(buffer, BUFFER_SIZE, file) != 0)
+
+    c->rx[c->rx_len] = 0;
+    c->tx_len = 0;
+    c->tx_off = 0;
+    c->replay_eof = 0;
+    client_replay_close(c);
+    fd = -1;
+    pos = 0;
+    result = -1;
+
+    wait_start = aesd_now_ns();
+    pthread_mutex_lock(&c->store->wr_mtx);
+    aesd_metrics_observe(AESD_LOCK_WAIT_NS, aesd_now_ns() - wait_start);
+    while((nl = memchr(c->rx + pos, '\n', c->rx_len - pos)) != NULL)
+    {
+        len = nl - (c->rx + pos) + 1;
+#ifdef ASSIGNMENT_9
+        *nl = 0;
+        seek = sscanf(c->rx + pos, "AESDCHAR_IOCSEEKTO:%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset) == 2;
+        *nl = '\n';
+        if(seek)
+        {
+            //replay from the seek position unless later packets are written
+            client_replay_close(c);
+            c->replay_fd = open(c->store->path, O_RDONLY);
+            if(c->replay_fd < 0)
+                goto out;
+            aesd_log(LOG_INFO, "Setting the file to position %u, %u", seekto.write_cmd, seekto.write_cmd_offset);
+            if(ioctl(c->replay_fd, AESDCHAR_IOCSEEKTO, &seekto) != 0)
+                goto out;
+            aesd_log(LOG_INFO, "IOCTL - OK");
+            pos += len;
+            continue;
+        }
+#endif /* ASSIGNMENT_9 */
+        if(fd < 0)
+        {
+            fd = open(c->store->path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+            if(fd < 0)
+                goto out;
+        }
+        if(write_all(fd, c->rx + pos, len) < 0)
+            goto out;
+        c->store->generation++;
+        client_replay_close(c);
+        aesd_metrics_add(AESD_PACKETS, 1);
+        pos += len;
+    }
+    if(pos < c->rx_len)
+        aesd_log(LOG_WARNING, "Dropping %zu unterminated bytes from %s", c->rx_len - pos, inet_ntoa(c->addr.sin_addr));
+    if(c->replay_fd < 0)
+    {
+        c->replay_fd = open(c->store->path, O_RDONLY);
+        if(c->replay_fd < 0)
+            goto out;
+    }
+    if(use_cache)
+        result = cache_attach(c, pos);
+    else
+        result = replay_prepare(c);
+    c->replay_sent = 0;
+    c->replaying = result == 0;
+out:
+    if(fd >= 0)
+        close(fd);
+    if(result < 0 && c->store->cache != NULL)
+    {
+        //part of the input may have been committed, take a fresh copy next time
+        cache_put(c->store->cache);
+        c->store->cache = NULL;
+    }
+    pthread_mutex_unlock(&c->store->wr_mtx);
+    c->rx_len = 0;
+    c->done = 1;
+    return result;
+}
+
+void* thread_entry(void *args)
+{
+    ssize_t recv_len;
+    struct client_t *c = (struct client_t*)args;
+
+    while(1)
+    {
+        //collect the packet locally, the write lock is taken only to commit it
+        if(client_rx_reserve(c) < 0)
+            goto t_exit_with_error;
+        recv_len = recv(c->sd, c->rx + c->rx_len, c->rx_size - c->rx_len - 1, 0);
+        if(recv_len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            goto t_exit_with_error;
+        }
+        else if(recv_len == 0)
+        {
+            //client terminated connection, finish the packets it completed
+            if(c->rx_len > 0 && memchr(c->rx, '\n', c->rx_len) != NULL)
             {
-                syslog(LOG_INFO, "server sends: %s", buffer);
-                if(send(c->sd, buffer, strlen(buffer), 0) < 0)
-                {
+                if(client_packet(c) < 0 || client_replay(c) < 0)
                     goto t_exit_with_error;
-                }
             }
             break;
         }
+        c->rx_len += recv_len;
+        aesd_metrics_add(AESD_BYTES_IN, recv_len);
+        //pipelined packets may end mid packet, keep receiving until the input ends with a newline
+        if(c->rx[c->rx_len - 1] == '\n')
+        {
+            if(client_packet(c) < 0)
+                goto t_exit_with_error;
+            PDEBUG("replaying to %s", inet_ntoa(c->addr.sin_addr));
+            if(client_replay(c) < 0)
+                goto t_exit_with_error;
+            break;
+        }
     }
-    fclose(file);
-    pthread_mutex_unlock(&wr_mtx);
     close(c->sd);
-    syslog(LOG_INFO, "Closed connection from %s\n", inet_ntoa(c->addr.sin_addr));
+    aesd_log(LOG_INFO, "Closed connection from %s\n", inet_ntoa(c->addr.sin_addr));
+    aesd_metrics_add(AESD_CLOSED, 1);
+    client_replay_close(c);
+    free(c->rx);
+    free(c->tx);
     return 0;
 
 t_exit_with_error:
-    syslog(LOG_ERR, "%s (CODE %d)", strerror(errno), errno);
+    aesd_log(LOG_ERR, "%s (CODE %d)", strerror(errno), errno);
     close(c->sd);
-    fclose(file);
-    pthread_mutex_unlock(&wr_mtx);
+    aesd_metrics_add(AESD_CLOSED, 1);
+    client_replay_close(c);
+    free(c->rx);
+    free(c->tx);
     return 0;
 }
 
@@ -154,6 +723,369 @@ void wait_for_threads()
 
 }
 
+/**
+ * Sends as much of the pending replay as the socket accepts.
+ * @return 1 if the client is finished and may be closed, 0 if it has to wait
+ * for EPOLLOUT or more input, -1 on error
+ */
+int event_client_flush(struct client_t *c)
+{
+    int result;
+
+    result = client_replay(c);
+    if(result <= 0)
+        return result;
+    return c->done;
+}
+
+/**
+ * Drains the socket (edge triggered) and handles a completed packet.
+ * @return same as event_client_flush
+ */
+int event_client_read(struct client_t *c)
+{
+    ssize_t len;
+    int eof;
+
+    eof = 0;
+    while(!eof)
+    {
+        if(client_rx_reserve(c) < 0)
+            return -1;
+        len = recv(c->sd, c->rx + c->rx_len, c->rx_size - c->rx_len - 1, 0);
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        else if(len == 0)
+        {
+            //client terminated connection, finish what was received
+            eof = 1;
+        }
+        aesd_metrics_add(AESD_BYTES_IN, len);
+        if(!c->done)
+            c->rx_len += len;
+    }
+    //pipelined packets may end mid packet, wait for the input to end with a newline or for EOF
+    if(!c->done && c->rx_len > 0 &&
+       (c->rx[c->rx_len - 1] == '\n' || (eof && memchr(c->rx, '\n', c->rx_len) != NULL)))
+    {
+        if(client_packet(c) < 0)
+            return -1;
+    }
+    if(eof)
+        c->done = 1;
+    return event_client_flush(c);
+}
+
+void event_client_close(struct event_loop_t *loop, struct client_t *c)
+{
+    pthread_mutex_lock(&loop->mtx);
+    LIST_REMOVE(c, entries);
+    pthread_mutex_unlock(&loop->mtx);
+    close(c->sd);
+    aesd_log(LOG_INFO, "Closed connection from %s\n", inet_ntoa(c->addr.sin_addr));
+    aesd_metrics_add(AESD_CLOSED, 1);
+    client_replay_close(c);
+    free(c->rx);
+    free(c->tx);
+    free(c);
+}
+
+void* event_loop_entry(void *args)
+{
+    struct event_loop_t *loop = (struct event_loop_t*)args;
+    struct epoll_event events[EVENT_MAX];
+    struct client_t *c;
+    int n, i, result;
+
+    while(run)
+    {
+        n = epoll_wait(loop->epfd, events, EVENT_MAX, -1);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            aesd_log(LOG_ERR, "%s (CODE %d)", strerror(errno), errno);
+            break;
+        }
+        for(i = 0; i < n; i++)
+        {
+            c = (struct client_t*)events[i].data.ptr;
+            if(c == NULL)
+            {
+                //woken up by main for shutdown
+                continue;
+            }
+            result = 0;
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                result = event_client_read(c);
+            if(result == 0 && (events[i].events & EPOLLOUT))
+                result = event_client_flush(c);
+            if(result != 0)
+            {
+                if(result < 0)
+                    aesd_log(LOG_ERR, "%s (CODE %d)", strerror(errno), errno);
+                event_client_close(loop, c);
+            }
+        }
+    }
+
+    while(!LIST_EMPTY(&loop->clients))
+        event_client_close(loop, LIST_FIRST(&loop->clients));
+    return 0;
+}
+
+int event_loop_add(struct event_loop_t *loop, struct client_t *c)
+{
+    struct epoll_event ev;
+    int flags;
+
+    flags = fcntl(c->sd, F_GETFL, 0);
+    if(flags < 0 || fcntl(c->sd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+    pthread_mutex_lock(&loop->mtx);
+    LIST_INSERT_HEAD(&loop->clients, c, entries);
+    pthread_mutex_unlock(&loop->mtx);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->sd, &ev) < 0)
+    {
+        pthread_mutex_lock(&loop->mtx);
+        LIST_REMOVE(c, entries);
+        pthread_mutex_unlock(&loop->mtx);
+        return -1;
+    }
+    return 0;
+}
+
+int start_event_loops(int count)
+{
+    struct epoll_event ev;
+    int i;
+
+    loops = (struct event_loop_t*)calloc(count, sizeof(struct event_loop_t));
+    if(loops == NULL)
+        return -1;
+    for(i = 0; i < count; i++)
+    {
+        LIST_INIT(&loops[i].clients);
+        pthread_mutex_init(&loops[i].mtx, 0);
+        loops[i].epfd = epoll_create1(0);
+        loops[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+        if(loops[i].epfd < 0 || loops[i].wake_fd < 0)
+            return -1;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if(epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wake_fd, &ev) < 0)
+            return -1;
+        if(pthread_create(&loops[i].tid, client_attrp, event_loop_entry, &loops[i]) != 0)
+            return -1;
+        nloops++;
+    }
+    return 0;
+}
+
+void stop_event_loops()
+{
+    int i;
+    uint64_t one = 1;
+
+    for(i = 0; i < nloops; i++)
+    {
+        if(write(loops[i].wake_fd, &one, sizeof(one)) < 0)
+            aesd_log(LOG_ERR, "%s (CODE %d)", strerror(errno), errno);
+    }
+    for(i = 0; i < nloops; i++)
+    {
+        pthread_join(loops[i].tid, 0);
+        close(loops[i].epfd);
+        close(loops[i].wake_fd);
+        pthread_mutex_destroy(&loops[i].mtx);
+    }
+    free(loops);
+    loops = NULL;
+    nloops = 0;
+}
+
+void* worker_entry(void *args)
+{
+    struct client_t *c;
+
+    while(1)
+    {
+        pthread_mutex_lock(&pool.mtx);
+        while(run && pool.count == 0)
+            pthread_cond_wait(&pool.has_work, &pool.mtx);
+        if(!run)
+        {
+            pthread_mutex_unlock(&pool.mtx);
+            break;
+        }
+        c = pool.queue[pool.head];
+        pool.head = (pool.head + 1) % pool.max_inflight;
+        pool.count--;
+        pthread_mutex_unlock(&pool.mtx);
+
+        thread_entry(c);
+        free(c);
+
+        pthread_mutex_lock(&pool.mtx);
+        pool.inflight--;
+        pthread_cond_signal(&pool.has_room);
+        pthread_mutex_unlock(&pool.mtx);
+    }
+    return 0;
+}
+
+int start_worker_pool(int workers, int max_inflight, int reject)
+{
+    int i;
+
+    pool.tids = (pthread_t*)calloc(workers, sizeof(pthread_t));
+    pool.queue = (struct client_t**)calloc(max_inflight, sizeof(struct client_t*));
+    if(pool.tids == NULL || pool.queue == NULL)
+        return -1;
+    pool.max_inflight = max_inflight;
+    pool.reject = reject;
+    pthread_mutex_init(&pool.mtx, 0);
+    pthread_cond_init(&pool.has_work, 0);
+    pthread_cond_init(&pool.has_room, 0);
+    for(i = 0; i < workers; i++)
+    {
+        if(pthread_create(&pool.tids[i], client_attrp, worker_entry, 0) != 0)
+            return -1;
+        pool.nworkers++;
+    }
+    return 0;
+}
+
+/**
+ * Hands an accepted connection to the pool. When max_inflight connections are
+ * already queued or being served the connection is either closed right away
+ * (reject) or the caller waits for a free slot, leaving further connections in
+ * the listen backlog.
+ * @return 0 if queued, -1 if the connection was not taken
+ */
+int worker_pool_submit(struct client_t *c)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&pool.mtx);
+    while(run && pool.inflight >= pool.max_inflight)
+    {
+        if(pool.reject)
+        {
+            pthread_mutex_unlock(&pool.mtx);
+            aesd_metrics_add(AESD_REJECTED, 1);
+            aesd_log_every(100, LOG_WARNING, "Overloaded, rejecting connection from %s", inet_ntoa(c->addr.sin_addr));
+            return -1;
+        }
+        //the signal handler cannot signal the condition, so poll run
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&pool.has_room, &pool.mtx, &ts);
+    }
+    if(!run)
+    {
+        pthread_mutex_unlock(&pool.mtx);
+        return -1;
+    }
+    pool.queue[(pool.head + pool.count) % pool.max_inflight] = c;
+    pool.count++;
+    pool.inflight++;
+    pthread_cond_signal(&pool.has_work);
+    pthread_mutex_unlock(&pool.mtx);
+    return 0;
+}
+
+void stop_worker_pool()
+{
+    int i;
+
+    if(pool.tids == NULL)
+        return;
+    pthread_mutex_lock(&pool.mtx);
+    pthread_cond_broadcast(&pool.has_work);
+    pthread_mutex_unlock(&pool.mtx);
+    for(i = 0; i < pool.nworkers; i++)
+        pthread_join(pool.tids[i], 0);
+    //connections still waiting in the queue are dropped
+    while(pool.count > 0)
+    {
+        close(pool.queue[pool.head]->sd);
+        aesd_metrics_add(AESD_CLOSED, 1);
+        free(pool.queue[pool.head]);
+        pool.head = (pool.head + 1) % pool.max_inflight;
+        pool.count--;
+    }
+    pthread_cond_destroy(&pool.has_work);
+    pthread_cond_destroy(&pool.has_room);
+    pthread_mutex_destroy(&pool.mtx);
+    free(pool.tids);
+    free(pool.queue);
+    memset(&pool, 0, sizeof(pool));
+}
+
+/**
+ * Sets up n backing stores. A single store uses OFN, more than one use OFN
+ * with the store number appended (/dev/aesdchar0, /dev/aesdchar1, ...).
+ * @return 0 on success, -1 on error
+ */
+int open_stores(int n)
+{
+    int i;
+
+    stores = (struct store_t*)calloc(n, sizeof(struct store_t));
+    if(stores == NULL)
+        return -1;
+    for(i = 0; i < n; i++)
+    {
+        if(n == 1)
+            snprintf(stores[i].path, sizeof(stores[i].path), "%s", OFN);
+        else
+            snprintf(stores[i].path, sizeof(stores[i].path), "%s%d", OFN, i);
+        pthread_mutex_init(&stores[i].wr_mtx, 0);
+    }
+    nstores = n;
+    return 0;
+}
+
+void close_stores(void)
+{
+    int i;
+
+    for(i = 0; i < nstores; i++)
+    {
+        cache_put(stores[i].cache);
+#ifndef ASSIGNMENT_8
+        remove(stores[i].path);
+#endif /* ASSIGNMENT_8 */
+        pthread_mutex_destroy(&stores[i].wr_mtx);
+    }
+    free(stores);
+    stores = NULL;
+    nstores = 0;
+}
+
+/**
+ * Picks the store for a client by hashing its address, so a client sees the
+ * same stream on every connection.
+ */
+struct store_t* store_for(const struct sockaddr_in *addr)
+{
+    uint32_t h;
+
+    h = ntohl(addr->sin_addr.s_addr) * 2654435761u;
+    return &stores[h % nstores];
+}
+
 #ifndef ASSIGNMENT_8
 void timer_handler(union sigval args)
 {
@@ -161,29 +1093,230 @@ void timer_handler(union sigval args)
     time_t ct;
     struct tm *ti;
     char ts[100];
+    size_t len;
+    int i;
 
     time(&ct);
     ti = localtime(&ct);
-    strftime(ts, 100, "timestamp:%a, %d %b %Y %H:%M:%S %z", ti);
-    f = fopen(OFN, "a");
-    pthread_mutex_lock(&wr_mtx);
-    fprintf(f, "%s\n", ts);
-    pthread_mutex_unlock(&wr_mtx);
-    fclose(f);
+    len = strftime(ts, sizeof(ts) - 1, "timestamp:%a, %d %b %Y %H:%M:%S %z", ti);
+    ts[len++] = '\n';
+    ts[len] = 0;
+    for(i = 0; i < nstores; i++)
+    {
+        pthread_mutex_lock(&stores[i].wr_mtx);
+        f = fopen(stores[i].path, "a");
+        if(f != NULL)
+        {
+            fputs(ts, f);
+            fclose(f);
+            if(stores[i].cache != NULL && cache_append(&stores[i], ts, len) < 0)
+                aesd_log(LOG_ERR, "%s (CODE %d)", strerror(errno), errno);
+        }
+        pthread_mutex_unlock(&stores[i].wr_mtx);
+    }
 }
 #endif
 
-int main(int argc, char **argv)
+int open_listener(unsigned short port, int backlog, int reuseport)
 {
     struct sockaddr_in sa;
-    struct client_t c;
-    char buffer[BUFFER_SIZE];
-    size_t len;
-    int recv_len;
-    FILE *file;
+    int sd;
+    int one;
+
+    sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(sd < 0)
+        return -1;
+    one = 1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_addr.s_addr = INADDR_ANY;
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if(setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+       (reuseport && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) ||
+       bind(sd, (struct sockaddr*)&sa, sizeof(sa)) < 0 ||
+       listen(sd, backlog) < 0)
+    {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+/**
+ * Accepts connections on one listener and hands them to the event loops, the
+ * worker pool or a new thread.
+ * @return 0 on shutdown, -1 on error
+ */
+int accept_loop(struct listener_t *l)
+{
+    struct client_t *entry;
+
+    while(run)
+    {
+        PDEBUG("waiting for connections on listener %ld", (long)(l - listeners));
+        entry = (struct client_t*)calloc(1, sizeof(struct client_t));
+        if(entry == NULL)
+            return -1;
+        entry->addr_len = sizeof(entry->addr);
+        entry->replay_fd = -1;
+        entry->pipe_fd[0] = -1;
+        entry->pipe_fd[1] = -1;
+        entry->sd = accept(l->sd, (struct sockaddr*)&entry->addr, &entry->addr_len);
+        if(entry->sd < 0)
+        {
+            free(entry);
+            if(errno == EINTR || errno == EINVAL)
+            {
+                aesd_log(LOG_INFO, "Shutting down\n");
+                break;
+            }
+            return -1;
+        }
+        aesd_log(LOG_INFO, "Accepted connection from %s", inet_ntoa(entry->addr.sin_addr));
+        aesd_metrics_add(AESD_ACCEPTED, 1);
+        entry->start_ns = aesd_now_ns();
+        entry->store = store_for(&entry->addr);
+
+        if(event_mode)
+        {
+            if(event_loop_add(&loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % nloops], entry) < 0)
+            {
+                aesd_log(LOG_ERR, "%s (CODE %d)", strerror(errno), errno);
+                close(entry->sd);
+                aesd_metrics_add(AESD_CLOSED, 1);
+                free(entry);
+            }
+            continue;
+        }
+        if(pool_workers > 0)
+        {
+            if(worker_pool_submit(entry) < 0)
+            {
+                close(entry->sd);
+                aesd_metrics_add(AESD_CLOSED, 1);
+                free(entry);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&cl_mtx);
+        pthread_create(&entry->tid, client_attrp, thread_entry, entry);
+        LIST_INSERT_HEAD(&cl_head, entry, entries);
+        pthread_mutex_unlock(&cl_mtx);
+    }
+    return 0;
+}
+
+void pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    if(cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        aesd_log(LOG_WARNING, "Cannot pin accept loop to CPU %d", cpu);
+}
+
+void* listener_entry(void *args)
+{
+    struct listener_t *l = (struct listener_t*)args;
+
+    pin_to_cpu(l->cpu);
+    if(accept_loop(l) < 0)
+        aesd_log(LOG_ERR, "%s (CODE %d)", strerror(errno), errno);
+    return 0;
+}
+
+/**
+ * Opens count listeners on PORT. More than one share the port with
+ * SO_REUSEPORT, so the kernel spreads incoming connections across them.
+ */
+int open_listeners(int count, int backlog, int affinity)
+{
+    cpu_set_t set;
+    int ncpu;
+    int i;
+
+    listeners = (struct listener_t*)calloc(count, sizeof(struct listener_t));
+    if(listeners == NULL)
+        return -1;
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if(affinity)
+    {
+        //threads inherit the affinity of their creator, client threads get the full mask back
+        if(sched_getaffinity(0, sizeof(set), &set) < 0 || pthread_attr_init(&client_attr) != 0)
+            return -1;
+        if(pthread_attr_setaffinity_np(&client_attr, sizeof(set), &set) != 0)
+            return -1;
+        client_attrp = &client_attr;
+    }
+    for(i = 0; i < count; i++)
+    {
+        listeners[i].sd = open_listener(PORT, backlog, count > 1);
+        if(listeners[i].sd < 0)
+            return -1;
+        listeners[i].cpu = affinity ? i % ncpu : -1;
+        nlisteners++;
+    }
+    return 0;
+}
+
+/**
+ * Runs the accept loops of all but the first listener in their own threads,
+ * the first one is run by the caller.
+ */
+int start_listeners()
+{
+    int i;
+
+    for(i = 1; i < nlisteners; i++)
+    {
+        if(pthread_create(&listeners[i].tid, 0, listener_entry, &listeners[i]) != 0)
+            return -1;
+        listeners[i].tid_valid = 1;
+    }
+    return 0;
+}
+
+void stop_listeners()
+{
+    int i;
+
+    run = 0;
+    for(i = 0; i < nlisteners; i++)
+        shutdown(listeners[i].sd, SHUT_RDWR);
+    for(i = 1; i < nlisteners; i++)
+    {
+        if(listeners[i].tid_valid)
+            pthread_join(listeners[i].tid, 0);
+    }
+    for(i = 0; i < nlisteners; i++)
+        close(listeners[i].sd);
+    nlisteners = 0;
+    free(listeners);
+    listeners = NULL;
+    if(client_attrp != NULL)
+    {
+        pthread_attr_destroy(client_attrp);
+        client_attrp = NULL;
+    }
+}
+
+int main(int argc, char **argv)
+{
     int daemon = 0;
+    int event_threads = 0;
+    int max_inflight = 0;
+    int reject = 0;
+    int log_level = LOG_INFO;
+    unsigned int log_rate = 0;
+    int metrics_port = 0;
+    int listener_count = 1;
+    int backlog = 5;
+    int affinity = 0;
+    int store_count = 1;
     int opt;
-    struct client_t *entry;
 #ifndef ASSIGNMENT_8
     timer_t timer;
     struct sigevent sev;
@@ -191,43 +1324,82 @@ int main(int argc, char **argv)
 #endif
 
     LIST_INIT(&cl_head);
-    pthread_mutex_init(&wr_mtx, 0);
+    pthread_mutex_init(&cl_mtx, 0);
 
-    while((opt = getopt(argc, argv, "d")) != -1)
+    while((opt = getopt(argc, argv, "det:w:m:rcl:L:M:s:b:aD:")) != -1)
     {
         switch(opt)
         {
             case 'd':
                 daemon = 1;
                 break;
+            case 'e':
+                event_mode = 1;
+                break;
+            case 't':
+                event_threads = atoi(optarg);
+                break;
+            case 'w':
+                pool_workers = atoi(optarg);
+                break;
+            case 'm':
+                max_inflight = atoi(optarg);
+                break;
+            case 'r':
+                reject = 1;
+                break;
+            case 'c':
+                use_cache = 1;
+                break;
+            case 'l':
+                log_level = atoi(optarg);
+                break;
+            case 'L':
+                log_rate = atoi(optarg);
+                break;
+            case 'M':
+                metrics_port = atoi(optarg);
+                break;
+            case 's':
+                listener_count = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'a':
+                affinity = 1;
+                break;
+            case 'D':
+                store_count = atoi(optarg);
+                break;
         }
     }
+    if(event_threads <= 0)
+        event_threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    //-m defaults to four connections per worker, an explicit limit is kept but covers at least the workers
+    if(max_inflight <= 0)
+        max_inflight = pool_workers * 4;
+    else if(max_inflight < pool_workers)
+    {
+        fprintf(stderr, "-m %d is below -w %d, allowing %d connections in flight\n", max_inflight, pool_workers, pool_workers);
+        max_inflight = pool_workers;
+    }
+    if(listener_count <= 0)
+        listener_count = 1;
+    if(store_count <= 0)
+        store_count = 1;
+    if(open_stores(store_count) < 0)
+        return -1;
 
     run = 1;
     signal(SIGINT, sd_handler);
     signal(SIGTERM, sd_handler);
+    //splice() and sendfile() have no MSG_NOSIGNAL, a peer closing mid replay fails that client with EPIPE
+    signal(SIGPIPE, SIG_IGN);
     
 
     openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER); 
-    server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (server < 0)
-    {
-        syslog(LOG_ERR, "[ERROR %d] %s\n", errno, strerror(errno));
-        return -1;
-    }
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_addr.s_addr = INADDR_ANY;
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(9000);
-    if(setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &run, sizeof(run)) < 0)
-    {
-        goto return_error;
-    }
-    if(bind(server, (struct sockaddr*)&sa, sizeof(sa)) < 0)
-    {
-        goto return_error;
-    }
-    if(listen(server, 5) < 0 )
+    if(open_listeners(listener_count, backlog, affinity) < 0)
     {
         goto return_error;
     }
@@ -239,10 +1411,15 @@ int main(int argc, char **argv)
             goto return_error;
         else if(daemon != 0)
         {
-            syslog(LOG_INFO, "running daemonized");
+            aesd_log(LOG_INFO, "running daemonized");
             return 0;
         }
     }
+    //the drain thread has to be started in the process that keeps running
+    if(aesd_log_start(log_level, log_rate) < 0)
+        goto return_error;
+    if(metrics_port > 0 && aesd_metrics_start(metrics_port) < 0)
+        goto return_error;
 
 #ifndef ASSIGNMENT_8
     memset(&sev, 0, sizeof(sev));
@@ -255,44 +1432,47 @@ int main(int argc, char **argv)
     its.it_interval.tv_sec = 10;
     timer_settime(timer, 0, &its, 0);
 #endif
-    while(run)
+    if(event_mode)
     {
-        syslog(LOG_INFO, "waiting for connections on port %hd", ntohs(sa.sin_port));
-        memset(&c, 0, sizeof(struct client_t));
-        entry = (struct client_t*)calloc(1, sizeof(struct client_t));
-        entry->sd = accept(server, (struct sockaddr*)&entry->addr, &entry->addr_len);
-        if(entry->sd < 0)
-        {
-            free(entry);
-            if(errno == EINTR || errno == EINVAL)
-            {
-                syslog(LOG_INFO, "Shutting down\n");
-                break;
-            }
+        if(start_event_loops(event_threads) < 0)
             goto return_error;
-        }
-        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(c.addr.sin_addr));
-        
-        //TODO: create thread
-        pthread_create(&entry->tid, 0, thread_entry, entry);
-        LIST_INSERT_HEAD(&cl_head, entry, entries);
+        aesd_log(LOG_INFO, "event loop mode with %d threads", event_threads);
     }
+    else if(pool_workers > 0)
+    {
+        if(start_worker_pool(pool_workers, max_inflight, reject) < 0)
+            goto return_error;
+        aesd_log(LOG_INFO, "worker pool with %d threads, %d connections in flight", pool_workers, max_inflight);
+    }
+    if(start_listeners() < 0)
+        goto return_error;
+    aesd_log(LOG_INFO, "%d listeners on port %d with backlog %d", nlisteners, PORT, backlog);
+    pin_to_cpu(listeners[0].cpu);
+    if(accept_loop(&listeners[0]) < 0)
+        goto return_error;
+    if(!run)
+        aesd_log(LOG_INFO, "Caught signal, exiting");
 
+    stop_listeners();
+    stop_event_loops();
+    stop_worker_pool();
     wait_for_threads();
-    close(server);
-#ifndef ASSIGNMENT_8
-    remove(OFN);
-#endif /* ASSIGNMENT_8 */
+    aesd_metrics_stop();
+    close_stores();
+    aesd_log_stop();
     closelog();
     return 0;
 
 
 return_error:
-    syslog(LOG_ERR, "[ERROR %d] %s\n", errno, strerror(errno));
+    aesd_log(LOG_ERR, "[ERROR %d] %s\n", errno, strerror(errno));
+    stop_listeners();
+    stop_event_loops();
+    stop_worker_pool();
     wait_for_threads();
+    aesd_metrics_stop();
+    close_stores();
+    aesd_log_stop();
     closelog();
-    close(server);
-    if(c.sd != 0)
-        close(c.sd);
     return -1;
-}
\ No newline at end of file
+}
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Checks that a client which sent a partial packet and then stalls does not
+# block other clients of a running aesdsocket. The stalled packet is stored,
+# so make check runs it against a server with its own scratch data file.
+# Usage: stall-test.sh [host] [port]
+
+set -u
+
+HOST=${1:-localhost}
+PORT=${2:-9000}
+TIMEOUT=5
+
+# keep a connection open with an unterminated packet
+exec 3<>/dev/tcp/${HOST}/${PORT}
+printf "stalled client" >&3
+
+OUTPUT=$(timeout ${TIMEOUT} bash -c "exec 4<>/dev/tcp/${HOST}/${PORT}; printf 'not blocked\n' >&4; cat <&4")
+rc=$?
+
+# finish the stalled packet so it does not linger on the server
+printf "\n" >&3
+cat <&3 > /dev/null
+exec 3<&-
+
+if [ $rc -ne 0 ]; then
+	echo "failed: no reply within ${TIMEOUT}s while another client was stalled"
+	exit 1
+fi
+echo "${OUTPUT}" | grep -q "not blocked"
+if [ $? -eq 0 ]; then
+	echo "success"
+	exit 0
+else
+	echo "failed: expected \"not blocked\" in ${OUTPUT}"
+	exit 1
+fi